@@ -0,0 +1,183 @@
+#include "Main.h"
+#include "SuperpixelBenchmark.h"
+
+#include <chrono>
+
+static double ElapsedMS(const chrono::high_resolution_clock::time_point &start)
+{
+    return chrono::duration<double, milli>(chrono::high_resolution_clock::now() - start).count();
+}
+
+void SuperpixelBenchmark::MakeTestImage(UINT width, UINT height, Bitmap &bmp)
+{
+    bmp.Allocate(width, height);
+    for(UINT y = 0; y < height; y++)
+    {
+        for(UINT x = 0; x < width; x++)
+        {
+            bmp[y][x] = RGBColor((x * 7 + y * 3) % 256, (int)(128 + 127 * sin(x * 0.05)), (int)(128 + 127 * cos(y * 0.07)));
+        }
+    }
+}
+
+void SuperpixelBenchmark::CompareQueues(const AppParameters &parameters, const Bitmap &bmp)
+{
+    Grid<UINT> heapAssignments;
+    for(SuperpixelQueueType queueType : { SuperpixelQueueType::binaryHeap, SuperpixelQueueType::bucket })
+    {
+        SuperpixelExtractorSuperpixel extractor;
+        extractor.options.queueType = queueType;
+
+        Vector<Superpixel> superpixels;
+        Grid<UINT> assignments;
+        const auto start = chrono::high_resolution_clock::now();
+        extractor.Extract(parameters, bmp, superpixels, assignments);
+        const double ms = ElapsedMS(start);
+
+        if(queueType == SuperpixelQueueType::binaryHeap) heapAssignments = assignments;
+        UINT64 sameCount = 0;
+        for(UINT y = 0; y < assignments.Rows(); y++)
+            for(UINT x = 0; x < assignments.Cols(); x++)
+                if(assignments(y, x) == heapAssignments(y, x)) sameCount++;
+
+        const double agreement = 100.0 * sameCount / ((double)assignments.Rows() * assignments.Cols());
+        Console::WriteLine(String(queueType == SuperpixelQueueType::binaryHeap ? "heap" : "bucket") + ": " + String(ms) + "ms, " + String(agreement) + "% of pixels match the heap");
+    }
+}
+
+void SuperpixelBenchmark::TimeSLIC(const AppParameters &parameters, const Bitmap &bmp, const Vector<UINT> &superpixelCounts)
+{
+    for(UINT superpixelCount : superpixelCounts)
+    {
+        AppParameters countParameters = parameters;
+        countParameters.superpixelCount = superpixelCount;
+
+        SuperpixelExtractorSLIC extractor;
+        Vector<Superpixel> superpixels;
+        Grid<UINT> assignments;
+        const auto start = chrono::high_resolution_clock::now();
+        extractor.Extract(countParameters, bmp, superpixels, assignments);
+        const double ms = ElapsedMS(start);
+
+        Console::WriteLine("SLIC " + String(superpixelCount) + " requested, " + String(superpixels.Length()) + " produced: " + String(ms) + "ms");
+    }
+}
+
+void SuperpixelBenchmark::CompareFeatureExtraction(const AppParameters &parameters, const Bitmap &bmp)
+{
+    SuperpixelExtractorPeriodic extractor;
+
+    auto start = chrono::high_resolution_clock::now();
+    const Vector<ColorCoordinate> coordinates = extractor.Extract(parameters, bmp);
+    const double coordinatesMS = ElapsedMS(start);
+
+    ColorCoordinateFeatures features;
+    start = chrono::high_resolution_clock::now();
+    extractor.ExtractFeatures(parameters, bmp, features);
+    const double featuresMS = ElapsedMS(start);
+
+    // a second extraction into the same object reuses its storage
+    start = chrono::high_resolution_clock::now();
+    extractor.ExtractFeatures(parameters, bmp, features);
+    const double reuseMS = ElapsedMS(start);
+
+    float maxDifference = 0.0f;
+    bool countsMatch = coordinates.Length() == features.count;
+    for(UINT i = 0; countsMatch && i < coordinates.Length(); i++)
+        for(UINT featureIndex = 0; featureIndex < 5; featureIndex++)
+            maxDifference = max(maxDifference, fabsf(coordinates[i].features[featureIndex] - features.Channel(featureIndex)[i]));
+
+    Console::WriteLine("ColorCoordinate: " + String(coordinatesMS) + "ms, ColorCoordinateFeatures: " + String(featuresMS) + "ms, reused: " + String(reuseMS) + "ms");
+    if(countsMatch) Console::WriteLine("feature max difference " + String(maxDifference));
+    else Console::WriteLine("sample counts differ: " + String(coordinates.Length()) + " vs " + String(features.count));
+}
+
+static float WeightedDistSq(const float *query, const ColorCoordinateFeatures &features, UINT index, const float *weights)
+{
+    float sum = 0.0f;
+    for(UINT featureIndex = 0; featureIndex < SuperpixelFeatureIndex::dimension; featureIndex++)
+    {
+        const float d = query[featureIndex] - features.Channel(featureIndex)[index];
+        sum += (weights == nullptr ? 1.0f : weights[featureIndex]) * d * d;
+    }
+    return sum;
+}
+
+void SuperpixelBenchmark::CompareFeatureIndex(UINT featureCount, UINT queryCount, UINT k, float radius)
+{
+    const UINT dimension = SuperpixelFeatureIndex::dimension;
+    SuperpixelRandom random(1);
+    auto uniform = [&]() { return (float)(random.Next() >> 40) / (float)(1 << 24); };
+
+    ColorCoordinateFeatures features;
+    features.Allocate(featureCount);
+    for(UINT featureIndex = 0; featureIndex < dimension; featureIndex++)
+        for(UINT i = 0; i < featureCount; i++)
+            features.Channel(featureIndex)[i] = uniform();
+
+    Vector<float> queries;
+    queries.Allocate(queryCount * dimension);
+    for(float &q : queries) q = uniform();
+
+    SuperpixelFeatureIndex index;
+    index.Build(features);
+
+    const float colorOnly[dimension] = { 1.0f, 1.0f, 1.0f, 0.0f, 0.0f };
+    for(const float *weights : { (const float *)nullptr, colorOnly })
+    {
+        Vector<UINT> nearest;
+        nearest.Allocate(queryCount * k);
+        Vector< Vector<UINT> > withinRadius;
+        auto start = chrono::high_resolution_clock::now();
+        index.KNearest(queries.CArray(), queryCount, k, nearest.CArray(), weights);
+        index.WithinRadius(queries.CArray(), queryCount, radius, withinRadius, weights);
+        const double indexMS = ElapsedMS(start);
+
+        // ties can reorder indices, so the k nearest are compared by distance
+        UINT mismatchCount = 0;
+        Vector<float> distances;
+        distances.Allocate(featureCount);
+        start = chrono::high_resolution_clock::now();
+        for(UINT queryIndex = 0; queryIndex < queryCount; queryIndex++)
+        {
+            const float *query = queries.CArray() + queryIndex * dimension;
+            UINT radiusCount = 0;
+            for(UINT i = 0; i < featureCount; i++)
+            {
+                distances[i] = WeightedDistSq(query, features, i, weights);
+                if(distances[i] <= radius * radius) radiusCount++;
+            }
+            sort(distances.begin(), distances.end());
+
+            bool match = radiusCount == withinRadius[queryIndex].Length();
+            for(UINT j = 0; match && j < min(k, featureCount); j++)
+                match = fabsf(distances[j] - WeightedDistSq(query, features, nearest[queryIndex * k + j], weights)) <= 1e-6f;
+            if(!match) mismatchCount++;
+        }
+        const double bruteForceMS = ElapsedMS(start);
+
+        Console::WriteLine(String(weights == nullptr ? "unweighted" : "color only") + ": k-d tree " + String(indexMS) + "ms, brute force " + String(bruteForceMS) + "ms, " + String(mismatchCount) + " mismatched queries");
+    }
+}
+
+void SuperpixelBenchmark::RunAll()
+{
+    Bitmap bmp;
+    MakeTestImage(1600, 1200, bmp);
+
+    AppParameters parameters;
+    parameters.superpixelCount = 400;
+    parameters.superpixelIterations = 2;
+    CompareQueues(parameters, bmp);
+
+    Vector<UINT> superpixelCounts;
+    superpixelCounts.PushEnd(400);
+    superpixelCounts.PushEnd(4000);
+    parameters.superpixelIterations = 5;
+    TimeSLIC(parameters, bmp, superpixelCounts);
+
+    parameters.periodicBasisCount = 3;
+    CompareFeatureExtraction(parameters, bmp);
+
+    CompareFeatureIndex(5000, 300, 7, 0.2f);
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+//
+// comparison runs for the superpixel extractors. each prints timings and how closely the variants
+// agree through Console::WriteLine. nothing here runs unless a caller asks for it.
+//
+class SuperpixelBenchmark
+{
+public:
+    // gradients plus a periodic pattern, deterministic so runs can be compared across builds
+    static void MakeTestImage(UINT width, UINT height, Bitmap &bmp);
+
+    // binary heap against bucket queue region growing: extraction time and fraction of pixels given the same label
+    static void CompareQueues(const AppParameters &parameters, const Bitmap &bmp);
+
+    // SLIC extraction time for each superpixel count; an iteration should cost about the same for all of them
+    static void TimeSLIC(const AppParameters &parameters, const Bitmap &bmp, const Vector<UINT> &superpixelCounts);
+
+    // SuperpixelExtractorPeriodic::Extract against ExtractFeatures: time and largest feature difference
+    static void CompareFeatureExtraction(const AppParameters &parameters, const Bitmap &bmp);
+
+    //
+    // SuperpixelFeatureIndex against a brute-force scan over random features, unweighted and color only.
+    // counts queries whose k nearest distances or radius result sizes differ, and times both.
+    //
+    static void CompareFeatureIndex(UINT featureCount, UINT queryCount, UINT k, float radius);
+
+    static void RunAll();
+};
@@ -1,5 +1,63 @@
 #include "Main.h"
 
+#include <limits>
+#include <unordered_set>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define SUPERPIXEL_SSE2
+#endif
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+//
+// runs f(0) .. f(count - 1) across threadCount threads, 0 meaning every hardware thread.
+// work is handed out one index at a time, so f must not depend on which thread runs it.
+//
+static void ParallelFor(UINT count, UINT threadCount, const function<void(UINT)> &f)
+{
+    if(threadCount == 0) threadCount = max(thread::hardware_concurrency(), 1u);
+    threadCount = min(threadCount, count);
+    if(threadCount <= 1)
+    {
+        for(UINT i = 0; i < count; i++) f(i);
+        return;
+    }
+
+    atomic<UINT> nextIndex(0);
+    vector<thread> threads;
+    for(UINT threadIndex = 0; threadIndex < threadCount; threadIndex++)
+    {
+        threads.push_back(thread([&]()
+        {
+            for(UINT i = nextIndex++; i < count; i = nextIndex++) f(i);
+        }));
+    }
+    for(thread &t : threads) t.join();
+}
+
+//
+// hands the observer the current mean color of every region. works for anything with a Vec3f color
+// member, so the region-growing and SLIC extractors share it.
+//
+template<class Region>
+static void NotifyObserver(SuperpixelObserver &observer, UINT iterationIndex, const Grid<UINT> &assignments, const Vector<Region> &regions)
+{
+    Vector<Vec3f> colors(regions.Length());
+    for(UINT regionIndex = 0; regionIndex < regions.Length(); regionIndex++)
+    {
+        colors[regionIndex] = regions[regionIndex].color;
+    }
+    observer.OnIteration(iterationIndex, assignments, colors);
+}
+
 Vector<ColorCoordinate> SuperpixelExtractorPeriodic::Extract(const AppParameters &parameters, const Bitmap &bmp)
 {
     Vector<ColorCoordinate> result;
@@ -14,11 +72,257 @@ Vector<ColorCoordinate> SuperpixelExtractorPeriodic::Extract(const AppParameters
     return result;
 }
 
+//
+// features for sampleCount pixels of one row, taken every period pixels starting at row[0].
+// xStep is the x feature distance between consecutive samples.
+//
+static void ExtractFeatureRow(const RGBColor *row, UINT sampleCount, UINT period, float xStep, float yFeature, float *r, float *g, float *b, float *x, float *y)
+{
+    UINT i = 0;
+#if defined(SUPERPIXEL_SSE2)
+    //
+    // RGBColor is four bytes r, g, b, a, so each 32-bit lane holds one pixel with r in the low byte
+    //
+    const __m128i byteMask = _mm_set1_epi32(0xFF);
+    const __m128 colorScale = _mm_set1_ps(1.0f / 255.0f);
+    const __m128 xLane = _mm_mul_ps(_mm_setr_ps(0.0f, 1.0f, 2.0f, 3.0f), _mm_set1_ps(xStep));
+    const __m128 yValue = _mm_set1_ps(yFeature);
+    const int *words = (const int *)row;
+    for(; i + 4 <= sampleCount; i += 4)
+    {
+        __m128i pixels;
+        if(period == 1) pixels = _mm_loadu_si128((const __m128i *)(words + i));
+        else pixels = _mm_setr_epi32(words[i * period], words[(i + 1) * period], words[(i + 2) * period], words[(i + 3) * period]);
+
+        _mm_storeu_ps(r + i, _mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(pixels, byteMask)), colorScale));
+        _mm_storeu_ps(g + i, _mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(pixels, 8), byteMask)), colorScale));
+        _mm_storeu_ps(b + i, _mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(pixels, 16), byteMask)), colorScale));
+        _mm_storeu_ps(x + i, _mm_add_ps(_mm_set1_ps(i * xStep), xLane));
+        _mm_storeu_ps(y + i, yValue);
+    }
+#endif
+    for(; i < sampleCount; i++)
+    {
+        const RGBColor &c = row[i * period];
+        r[i] = c.r / 255.0f;
+        g[i] = c.g / 255.0f;
+        b[i] = c.b / 255.0f;
+        x[i] = i * xStep;
+        y[i] = yFeature;
+    }
+}
+
+void SuperpixelExtractorPeriodic::ExtractFeatures(const AppParameters &parameters, const Bitmap &bmp, ColorCoordinateFeatures &featuresOut)
+{
+    const UINT period = max(parameters.periodicBasisCount, 1u);
+    const UINT samplesX = (bmp.Width() + period - 1) / period;
+    const UINT samplesY = (bmp.Height() + period - 1) / period;
+    featuresOut.Allocate(samplesX * samplesY);
+
+    const float xStep = period / (float)bmp.Width() * parameters.spatialToColorScale;
+    for(UINT sampleY = 0; sampleY < samplesY; sampleY++)
+    {
+        const UINT y = sampleY * period;
+        const UINT offset = sampleY * samplesX;
+        ExtractFeatureRow(&bmp[y][0], samplesX, period, xStep, y / (float)bmp.Height() * parameters.spatialToColorScale,
+            featuresOut.Channel(0) + offset, featuresOut.Channel(1) + offset, featuresOut.Channel(2) + offset,
+            featuresOut.Channel(3) + offset, featuresOut.Channel(4) + offset);
+    }
+}
+
+void SuperpixelFeatureIndex::Build(const Vector<ColorCoordinate> &superpixels)
+{
+    ColorCoordinateFeatures features;
+    features.Allocate(superpixels.Length());
+    for(UINT i = 0; i < superpixels.Length(); i++)
+    {
+        for(UINT d = 0; d < dimension; d++) features.Channel(d)[i] = superpixels[i].features[d];
+    }
+    Build(features);
+}
+
+void SuperpixelFeatureIndex::Build(const ColorCoordinateFeatures &features)
+{
+    _points.Allocate(features.count * dimension);
+    _indices.Allocate(features.count);
+    for(UINT i = 0; i < features.count; i++)
+    {
+        _indices[i] = i;
+        for(UINT d = 0; d < dimension; d++) _points[i * dimension + d] = features.Channel(d)[i];
+    }
+
+    _nodes.Clear();
+    if(features.count > 0) BuildNode(0, features.count);
+}
+
+int SuperpixelFeatureIndex::BuildNode(UINT begin, UINT end)
+{
+    const UINT leafSize = 8;
+    const int nodeIndex = _nodes.Length();
+    Node node;
+    node.begin = begin;
+    node.end = end;
+    node.left = node.right = -1;
+    node.splitDimension = 0;
+    node.splitValue = 0.0f;
+    _nodes.PushEnd(node);
+    if(end - begin <= leafSize) return nodeIndex;
+
+    //
+    // Split at the median of the dimension with the largest spread
+    //
+    float bestSpread = -1.0f;
+    UINT splitDimension = 0;
+    for(UINT d = 0; d < dimension; d++)
+    {
+        float low = numeric_limits<float>::max(), high = -numeric_limits<float>::max();
+        for(UINT i = begin; i < end; i++)
+        {
+            low = min(low, _points[i * dimension + d]);
+            high = max(high, _points[i * dimension + d]);
+        }
+        if(high - low > bestSpread)
+        {
+            bestSpread = high - low;
+            splitDimension = d;
+        }
+    }
+
+    Vector<UINT> order(end - begin);
+    for(UINT i = 0; i < end - begin; i++) order[i] = begin + i;
+    const UINT middle = (end - begin) / 2;
+    nth_element(order.begin(), order.begin() + middle, order.end(), [&](UINT a, UINT b)
+    {
+        return _points[a * dimension + splitDimension] < _points[b * dimension + splitDimension];
+    });
+
+    Vector<float> points((end - begin) * dimension);
+    Vector<UINT> indices(end - begin);
+    for(UINT i = 0; i < end - begin; i++)
+    {
+        for(UINT d = 0; d < dimension; d++) points[i * dimension + d] = _points[order[i] * dimension + d];
+        indices[i] = _indices[order[i]];
+    }
+    for(UINT i = 0; i < end - begin; i++)
+    {
+        for(UINT d = 0; d < dimension; d++) _points[(begin + i) * dimension + d] = points[i * dimension + d];
+        _indices[begin + i] = indices[i];
+    }
+
+    const float splitValue = _points[(begin + middle) * dimension + splitDimension];
+    const int left = BuildNode(begin, begin + middle);
+    const int right = BuildNode(begin + middle, end);
+    _nodes[nodeIndex].left = left;
+    _nodes[nodeIndex].right = right;
+    _nodes[nodeIndex].splitDimension = splitDimension;
+    _nodes[nodeIndex].splitValue = splitValue;
+    return nodeIndex;
+}
+
+float SuperpixelFeatureIndex::DistSq(const float *query, UINT point, const float *weights) const
+{
+    const float *p = &_points[point * dimension];
+    float sum = 0.0f;
+    for(UINT d = 0; d < dimension; d++)
+    {
+        const float diff = query[d] - p[d];
+        sum += (weights == nullptr ? 1.0f : weights[d]) * diff * diff;
+    }
+    return sum;
+}
+
+void SuperpixelFeatureIndex::SearchKNearest(int nodeIndex, const float *query, const float *weights, UINT k, UINT &found, float *bestDistances, UINT *bestIndices) const
+{
+    const Node &node = _nodes[nodeIndex];
+    if(node.left == -1)
+    {
+        //
+        // Insertion into the sorted best list; k is small so this beats a heap
+        //
+        for(UINT i = node.begin; i < node.end; i++)
+        {
+            const float dist = DistSq(query, i, weights);
+            if(found == k && dist >= bestDistances[k - 1]) continue;
+
+            UINT slot = found < k ? found++ : k - 1;
+            while(slot > 0 && bestDistances[slot - 1] > dist)
+            {
+                bestDistances[slot] = bestDistances[slot - 1];
+                bestIndices[slot] = bestIndices[slot - 1];
+                slot--;
+            }
+            bestDistances[slot] = dist;
+            bestIndices[slot] = i;
+        }
+        return;
+    }
+
+    const float diff = query[node.splitDimension] - node.splitValue;
+    const float planeDistSq = (weights == nullptr ? 1.0f : weights[node.splitDimension]) * diff * diff;
+    const int nearChild = diff < 0.0f ? node.left : node.right;
+    const int farChild = diff < 0.0f ? node.right : node.left;
+    SearchKNearest(nearChild, query, weights, k, found, bestDistances, bestIndices);
+    if(found < k || planeDistSq < bestDistances[k - 1])
+    {
+        SearchKNearest(farChild, query, weights, k, found, bestDistances, bestIndices);
+    }
+}
+
+void SuperpixelFeatureIndex::SearchRadius(int nodeIndex, const float *query, const float *weights, float radiusSq, Vector<UINT> &result) const
+{
+    const Node &node = _nodes[nodeIndex];
+    if(node.left == -1)
+    {
+        for(UINT i = node.begin; i < node.end; i++)
+        {
+            if(DistSq(query, i, weights) <= radiusSq) result.PushEnd(_indices[i]);
+        }
+        return;
+    }
+
+    const float diff = query[node.splitDimension] - node.splitValue;
+    const float planeDistSq = (weights == nullptr ? 1.0f : weights[node.splitDimension]) * diff * diff;
+    const int nearChild = diff < 0.0f ? node.left : node.right;
+    const int farChild = diff < 0.0f ? node.right : node.left;
+    SearchRadius(nearChild, query, weights, radiusSq, result);
+    if(planeDistSq <= radiusSq) SearchRadius(farChild, query, weights, radiusSq, result);
+}
+
+void SuperpixelFeatureIndex::KNearest(const float *queries, UINT queryCount, UINT k, UINT *resultsOut, const float *weights) const
+{
+    if(k == 0) return;
+    ParallelFor(queryCount, 0, [&](UINT queryIndex)
+    {
+        Vector<float> bestDistances(k);
+        UINT *bestIndices = resultsOut + size_t(queryIndex) * k;
+        UINT found = 0;
+        if(_nodes.Length() > 0) SearchKNearest(0, queries + queryIndex * dimension, weights, k, found, bestDistances.CArray(), bestIndices);
+        for(UINT i = 0; i < found; i++) bestIndices[i] = _indices[bestIndices[i]];
+        for(UINT i = found; i < k; i++) bestIndices[i] = 0xFFFFFFFF;
+    });
+}
+
+void SuperpixelFeatureIndex::WithinRadius(const float *queries, UINT queryCount, float radius, Vector< Vector<UINT> > &resultsOut, const float *weights) const
+{
+    resultsOut.Allocate(queryCount);
+    ParallelFor(queryCount, 0, [&](UINT queryIndex)
+    {
+        resultsOut[queryIndex].Clear();
+        if(_nodes.Length() > 0) SearchRadius(0, queries + queryIndex * dimension, weights, radius * radius, resultsOut[queryIndex]);
+    });
+}
+
 void Superpixel::Reset(const Bitmap &bmp, const Vec2i &_seed)
 {
-    pixels.FreeMemory();
+    pixels.Clear();
+    ClearSums();
     seed = _seed;
-    AddCoord(seed);
+    AddCoord(bmp, seed);
+}
+
+Vec2f Superpixel::Centroid() const
+{
+    return Vec2f(float(coordSum[0] / pixels.Length()), float(coordSum[1] / pixels.Length()));
 }
 
 Vec2i Superpixel::MassCentroid() const
@@ -53,9 +357,62 @@ void Superpixel::ResetColor( const RGBColor &_color )
 
 void Superpixel::ComputeColor( const Bitmap &bmp )
 {
-    color = Vec3f::Origin;
-    for(Vec2i p : pixels) color += Vec3f(bmp[p.y][p.x]);
-    color /= (float)pixels.Length();
+    const double scale = 1.0 / (255.0 * pixels.Length());
+    color = Vec3f(float(colorSum[0] * scale), float(colorSum[1] * scale), float(colorSum[2] * scale));
+}
+
+void SuperpixelExtractorSuperpixel::Queue::Init(SuperpixelQueueType type, UINT bucketCount)
+{
+    _type = type;
+    _heap = priority_queue<QueueEntry>();
+    _buckets.clear();
+    if(_type == SuperpixelQueueType::bucket) _buckets.resize(max(bucketCount, 1u));
+    _minBucket = (UINT)_buckets.size();
+    _size = 0;
+}
+
+UINT SuperpixelExtractorSuperpixel::Queue::BucketIndex(double priority) const
+{
+    //
+    // priority is 1 - squared RGB distance with channels in [0, 1], so the error lies in [0, 3]
+    //
+    const double maxError = 3.0;
+    const double error = min(max(1.0 - priority, 0.0), maxError);
+    return min((UINT)(error / maxError * _buckets.size()), (UINT)_buckets.size() - 1);
+}
+
+void SuperpixelExtractorSuperpixel::Queue::Push(const QueueEntry &entry)
+{
+    _size++;
+    if(_type == SuperpixelQueueType::binaryHeap)
+    {
+        _heap.push(entry);
+        return;
+    }
+
+    const UINT bucket = BucketIndex(entry.priority);
+    _buckets[bucket].push_back(entry);
+    if(bucket < _minBucket) _minBucket = bucket;
+}
+
+SuperpixelExtractorSuperpixel::QueueEntry SuperpixelExtractorSuperpixel::Queue::Pop()
+{
+    _size--;
+    if(_type == SuperpixelQueueType::binaryHeap)
+    {
+        QueueEntry entry = _heap.top();
+        _heap.pop();
+        return entry;
+    }
+
+    //
+    // not O(1): a push below _minBucket moves it back, so this scan can repeat levels it already passed.
+    // region growing pushes errors close to the one just popped, which keeps the scan short in practice.
+    //
+    while(_buckets[_minBucket].empty()) _minBucket++;
+    QueueEntry entry = _buckets[_minBucket].back();
+    _buckets[_minBucket].pop_back();
+    return entry;
 }
 
 Vector<ColorCoordinate> SuperpixelExtractorSuperpixel::Extract(const AppParameters &parameters, const Bitmap &bmp)
@@ -84,25 +441,19 @@ void SuperpixelExtractorSuperpixel::Extract(const AppParameters &parameters, con
     _dimensions = Vec2i(bmp.Width(), bmp.Height());
     _assignments.Allocate(_dimensions.y, _dimensions.x);
     _superpixels.Allocate(parameters.superpixelCount);
+    _random = SuperpixelRandom(options.seed);
+    _queue.Init(options.queueType, options.bucketCount);
 
     InitializeSuperpixels(parameters, bmp);
 
     const UINT iterationCount = parameters.superpixelIterations;
     for(UINT iterationIndex = 0; iterationIndex < iterationCount; iterationIndex++)
     {
-        Console::WriteLine("Starting superpixel iteration " + String(iterationIndex));
+        if(options.observer != nullptr) options.observer->OnIterationStart(iterationIndex);
         //ComponentTimer timer( "Iteration " + String(iterationIndex) );
         GrowSuperpixels(parameters, bmp);
 
-        const bool dumpIntermediateResults = true;
-        if(dumpIntermediateResults)
-        {
-            Bitmap clusterBmp0, clusterBmp1;
-            DrawSuperpixelIDs(_assignments, clusterBmp0);
-            DrawSuperpixelColors(bmp, clusterBmp1);
-            clusterBmp0.SavePNG("clustersIteration" + String(iterationIndex) + ".png");
-            clusterBmp1.SavePNG("colorsIteration" + String(iterationIndex) + ".png");
-        }
+        if(options.observer != nullptr) NotifyObserver(*options.observer, iterationIndex, _assignments, _superpixels);
 
         RecenterSuperpixels(parameters, bmp);
     }
@@ -118,20 +469,68 @@ void SuperpixelExtractorSuperpixel::Extract(const AppParameters &parameters, con
 
 }
 
-void SuperpixelExtractorSuperpixel::InitializeSuperpixels(const AppParameters &parameters, const Bitmap &bmp)
+void SuperpixelExtractorSuperpixel::MakeTargets(const Bitmap &bmp, const Vector<Superpixel> &superpixels, double maxVariance, vector<SuperpixelTarget> &targetsOut)
 {
-    Vector<Vec2i> seeds;
-    for(Superpixel &p : _superpixels)
+    targetsOut.clear();
+    for(const Superpixel &p : superpixels)
     {
-        Vec2i randomSeed(rand() % _dimensions.x, rand() % _dimensions.y);
-        while(seeds.Contains(randomSeed))
+        if(p.pixels.Length() == 0) continue;
+
+        double variance = 0.0;
+        for(const Vec2i &coord : p.pixels) variance += Vec3f::DistSq(p.color, Vec3f(bmp[coord.y][coord.x]));
+        variance /= p.pixels.Length();
+
+        if(variance > maxVariance)
         {
-            randomSeed = Vec2i(rand() % _dimensions.x, rand() % _dimensions.y);
+            for(const Vec2i &coord : p.pixels)
+            {
+                const Vec3f c(bmp[coord.y][coord.x]);
+                targetsOut.push_back(SuperpixelTarget::pixel(c.x, c.y, c.z, coord.x, coord.y));
+            }
+            continue;
         }
-        
-        p.ResetColor(bmp[randomSeed.y][randomSeed.x]);
-        p.Reset(bmp, randomSeed);
-        seeds.PushEnd(randomSeed);
+
+        SuperpixelTarget target = SuperpixelTarget::pixel(p.color.x, p.color.y, p.color.z, p.seed.x, p.seed.y);
+        target.pixelCount = p.pixels.Length();
+        target.weight = sqrt((double)target.pixelCount);
+        targetsOut.push_back(target);
+    }
+}
+
+void SuperpixelExtractorSuperpixel::InitializeSuperpixels(const AppParameters &parameters, const Bitmap &bmp)
+{
+    //
+    // Stratified blue-noise seeds: a grid with at least superpixelCount cells, one seed jittered within the middle
+    // half of each cell, and surplus cells dropped at random. seeds are unique and at least half a cell apart by
+    // construction, so no rejection test is needed.
+    //
+    const UINT superpixelCount = _superpixels.Length();
+    const double cellSize = max(sqrt(double(_dimensions.x) * double(_dimensions.y) / max(superpixelCount, 1u)), 1.0);
+    const int cellsX = min((int)ceil(_dimensions.x / cellSize), _dimensions.x);
+    const int cellsY = min((int)ceil(_dimensions.y / cellSize), _dimensions.y);
+
+    Vector<UINT> cells(cellsX * cellsY);
+    for(UINT i = 0; i < cells.Length(); i++) cells[i] = i;
+    for(UINT i = 0; i < superpixelCount && i < cells.Length(); i++)
+    {
+        swap(cells[i], cells[i + _random.Uniform(cells.Length() - i)]);
+    }
+
+    for(UINT superpixelIndex = 0; superpixelIndex < superpixelCount; superpixelIndex++)
+    {
+        //
+        // Only reachable when there are more superpixels than pixels
+        //
+        const UINT cell = cells[superpixelIndex % cells.Length()];
+        const int cellX = cell % cellsX, cellY = cell / cellsX;
+        const int x0 = cellX * _dimensions.x / cellsX, x1 = (cellX + 1) * _dimensions.x / cellsX;
+        const int y0 = cellY * _dimensions.y / cellsY, y1 = (cellY + 1) * _dimensions.y / cellsY;
+        const Vec2i seed(x0 + (x1 - x0) / 4 + _random.Uniform(max((x1 - x0) / 2, 1)),
+                         y0 + (y1 - y0) / 4 + _random.Uniform(max((y1 - y0) / 2, 1)));
+
+        Superpixel &p = _superpixels[superpixelIndex];
+        p.ResetColor(bmp[seed.y][seed.x]);
+        p.Reset(bmp, seed);
     }
 }
 
@@ -142,7 +541,7 @@ void SuperpixelExtractorSuperpixel::AssignPixel(const AppParameters &parameters,
         return;
     }
     _assignments(coord.y, coord.x) = superpixelIndex;
-    _superpixels[superpixelIndex].AddCoord(coord);
+    _superpixels[superpixelIndex].AddCoord(bmp, coord);
 
     const UINT neighborCount = 4;
     const UINT XOffsets[neighborCount] = {-1, 1, 0, 0};
@@ -156,13 +555,19 @@ void SuperpixelExtractorSuperpixel::AssignPixel(const AppParameters &parameters,
             newEntry.superpixelIndex = superpixelIndex;
             newEntry.coord = finalCoord;
             newEntry.priority = 1.0 - _superpixels[superpixelIndex].AssignmentError(bmp, finalCoord);
-            _queue.push(newEntry);
+            _queue.Push(newEntry);
         }
     }
 }
 
 void SuperpixelExtractorSuperpixel::GrowSuperpixels(const AppParameters &parameters, const Bitmap &bmp)
 {
+    if(options.tiledGrowth)
+    {
+        GrowSuperpixelsTiled(parameters, bmp);
+        return;
+    }
+
     _assignments.Clear(0xFFFFFFFF);
 
     //
@@ -173,49 +578,249 @@ void SuperpixelExtractorSuperpixel::GrowSuperpixels(const AppParameters &paramet
         AssignPixel(parameters, bmp, _superpixels[superpixelIndex].seed, superpixelIndex);
     }
 
-    while(!_queue.empty())
+    while(!_queue.Empty())
+    {
+        QueueEntry curEntry = _queue.Pop();
+        AssignPixel(parameters, bmp, curEntry.coord, curEntry.superpixelIndex);
+    }
+}
+
+void SuperpixelExtractorSuperpixel::GrowSuperpixelsTiled(const AppParameters &parameters, const Bitmap &bmp)
+{
+    _assignments.Clear(0xFFFFFFFF);
+
+    const int tileSize = max((int)options.tileSize, 1);
+    const int tilesX = (_dimensions.x + tileSize - 1) / tileSize;
+    const int tilesY = (_dimensions.y + tileSize - 1) / tileSize;
+    const UINT tileCount = tilesX * tilesY;
+
+    //
+    // Each superpixel only grows inside the tile that holds its seed
+    //
+    Vector< Vector<UINT> > tileSuperpixels;
+    tileSuperpixels.Allocate(tileCount);
+    for(UINT superpixelIndex = 0; superpixelIndex < _superpixels.Length(); superpixelIndex++)
+    {
+        const Vec2i &seed = _superpixels[superpixelIndex].seed;
+        tileSuperpixels[(seed.y / tileSize) * tilesX + seed.x / tileSize].PushEnd(superpixelIndex);
+    }
+
+    Vector< Vector<QueueEntry> > borderEntries;
+    borderEntries.Allocate(tileCount);
+    ParallelFor(tileCount, options.threadCount, [&](UINT tileIndex)
+    {
+        const Vec2i tileMin((tileIndex % tilesX) * tileSize, (tileIndex / tilesX) * tileSize);
+        const Vec2i tileMax(min(tileMin.x + tileSize, _dimensions.x), min(tileMin.y + tileSize, _dimensions.y));
+        GrowTile(bmp, tileMin, tileMax, tileSuperpixels[tileIndex], borderEntries[tileIndex]);
+    });
+
+    //
+    // Stitch: continue growing across tile borders from one queue, in tile order so the result is deterministic
+    //
+    for(const Vector<QueueEntry> &entries : borderEntries)
+    {
+        for(const QueueEntry &e : entries)
+        {
+            if(_assignments(e.coord.y, e.coord.x) == 0xFFFFFFFF) _queue.Push(e);
+        }
+    }
+
+    while(!_queue.Empty())
     {
-        QueueEntry curEntry = _queue.top();
-        _queue.pop();
+        QueueEntry curEntry = _queue.Pop();
         AssignPixel(parameters, bmp, curEntry.coord, curEntry.superpixelIndex);
     }
 }
 
+void SuperpixelExtractorSuperpixel::GrowTile(const Bitmap &bmp, const Vec2i &tileMin, const Vec2i &tileMax, const Vector<UINT> &tileSuperpixels, Vector<QueueEntry> &borderEntries)
+{
+    //
+    // Same flood fill as AssignPixel, but never reads or writes assignments outside the tile;
+    // neighbors across the border are handed back to the stitching pass instead
+    //
+    Queue queue;
+    queue.Init(options.queueType, options.bucketCount);
+    auto assign = [&](const Vec2i &coord, UINT superpixelIndex)
+    {
+        if(_assignments(coord.y, coord.x) != 0xFFFFFFFF)
+        {
+            return;
+        }
+        _assignments(coord.y, coord.x) = superpixelIndex;
+        _superpixels[superpixelIndex].AddCoord(bmp, coord);
+
+        const UINT neighborCount = 4;
+        const int XOffsets[neighborCount] = {-1, 1, 0, 0};
+        const int YOffsets[neighborCount] = {0, 0, -1, 1};
+        for(UINT neighborIndex = 0; neighborIndex < neighborCount; neighborIndex++)
+        {
+            Vec2i finalCoord(coord.x + XOffsets[neighborIndex], coord.y + YOffsets[neighborIndex]);
+            if(!_assignments.ValidCoordinates(finalCoord.y, finalCoord.x))
+            {
+                continue;
+            }
+
+            QueueEntry newEntry;
+            newEntry.superpixelIndex = superpixelIndex;
+            newEntry.coord = finalCoord;
+            newEntry.priority = 1.0 - _superpixels[superpixelIndex].AssignmentError(bmp, finalCoord);
+
+            const bool insideTile = finalCoord.x >= tileMin.x && finalCoord.x < tileMax.x && finalCoord.y >= tileMin.y && finalCoord.y < tileMax.y;
+            if(!insideTile)
+            {
+                borderEntries.PushEnd(newEntry);
+            }
+            else if(_assignments(finalCoord.y, finalCoord.x) == 0xFFFFFFFF)
+            {
+                queue.Push(newEntry);
+            }
+        }
+    };
+
+    for(UINT superpixelIndex : tileSuperpixels)
+    {
+        assign(_superpixels[superpixelIndex].seed, superpixelIndex);
+    }
+
+    while(!queue.Empty())
+    {
+        QueueEntry curEntry = queue.Pop();
+        assign(curEntry.coord, curEntry.superpixelIndex);
+    }
+}
+
 void SuperpixelExtractorSuperpixel::RecenterSuperpixels(const AppParameters &parameters, const Bitmap &bmp)
 {
     const UINT clusterSizeCutoff = 10;
 
     UINT teleportCount = 0;
-    Vector<Vec2i> seeds;
-    for(Superpixel &p : _superpixels)
+    unordered_set<UINT> seeds;
+    for(UINT superpixelIndex = 0; superpixelIndex < _superpixels.Length(); superpixelIndex++)
     {
+        Superpixel &p = _superpixels[superpixelIndex];
         Vec2i newSeed;
         if(p.pixels.Length() < clusterSizeCutoff)
         {
-            newSeed = Vec2i(rand() % _dimensions.x, rand() % _dimensions.y);
-            while(seeds.Contains(newSeed))
+            newSeed = Vec2i(_random.Uniform(_dimensions.x), _random.Uniform(_dimensions.y));
+            while(seeds.count(newSeed.y * _dimensions.x + newSeed.x))
             {
-                newSeed = Vec2i(rand() % _dimensions.x, rand() % _dimensions.y);
+                newSeed = Vec2i(_random.Uniform(_dimensions.x), _random.Uniform(_dimensions.y));
             }
             teleportCount++;
             p.ResetColor(bmp[newSeed.y][newSeed.x]);
         }
         else
         {
-            newSeed = p.MassCentroid();
+            //
+            // The pixel nearest the centroid is the rounded centroid whenever the superpixel owns it;
+            // only non-convex superpixels need the full scan
+            //
+            const Vec2f centroid = p.Centroid();
+            const Vec2i roundedCentroid((int)(centroid.x + 0.5f), (int)(centroid.y + 0.5f));
+            if(_assignments(roundedCentroid.y, roundedCentroid.x) == superpixelIndex) newSeed = roundedCentroid;
+            else newSeed = p.MassCentroid();
             p.ComputeColor(bmp);
         }
         p.Reset(bmp, newSeed);
-        seeds.PushEnd(newSeed);
+        seeds.insert(newSeed.y * _dimensions.x + newSeed.x);
     }
 }
 
-void SuperpixelExtractorSuperpixel::DrawSuperpixelIDs(const Grid<UINT> &superpixelIDs, Bitmap &bmp)
+SuperpixelImageWriter::SuperpixelImageWriter(bool async)
 {
+    _async = async;
+    _busy = false;
+    _stop = false;
+    if(_async) _thread = thread(&SuperpixelImageWriter::WriterThread, this);
+}
+
+SuperpixelImageWriter::~SuperpixelImageWriter()
+{
+    if(!_async) return;
+    {
+        lock_guard<mutex> lock(_mutex);
+        _stop = true;
+    }
+    _wake.notify_one();
+    _thread.join();
+}
+
+void SuperpixelImageWriter::OnIterationStart(UINT iterationIndex)
+{
+    Console::WriteLine("Starting superpixel iteration " + String(iterationIndex));
+}
+
+void SuperpixelImageWriter::OnIteration(UINT iterationIndex, const Grid<UINT> &assignments, const Vector<Vec3f> &colors)
+{
+    Job job;
+    job.iterationIndex = iterationIndex;
+    job.assignments = assignments;
+    job.colors = colors;
+    if(!_async)
+    {
+        Write(job);
+        return;
+    }
+
+    {
+        lock_guard<mutex> lock(_mutex);
+        _jobs.push_back(std::move(job));
+    }
+    _wake.notify_one();
+}
+
+void SuperpixelImageWriter::Flush()
+{
+    if(!_async) return;
+    unique_lock<mutex> lock(_mutex);
+    _idle.wait(lock, [&]() { return _jobs.empty() && !_busy; });
+}
+
+void SuperpixelImageWriter::WriterThread()
+{
+    //
+    // Drains the queue before stopping, so every image handed to the writer ends up on disk
+    //
+    unique_lock<mutex> lock(_mutex);
+    while(true)
+    {
+        _wake.wait(lock, [&]() { return _stop || !_jobs.empty(); });
+        if(_jobs.empty()) return;
+
+        Job job = std::move(_jobs.front());
+        _jobs.pop_front();
+        _busy = true;
+        lock.unlock();
+        Write(job);
+        lock.lock();
+        _busy = false;
+        if(_jobs.empty()) _idle.notify_all();
+    }
+}
+
+void SuperpixelImageWriter::Write(const Job &job)
+{
+    Bitmap clusterBmp0, clusterBmp1;
+    DrawSuperpixelIDs(job.assignments, clusterBmp0);
+    DrawSuperpixelColors(job.assignments, job.colors, clusterBmp1);
+    clusterBmp0.SavePNG("clustersIteration" + String(job.iterationIndex) + ".png");
+    clusterBmp1.SavePNG("colorsIteration" + String(job.iterationIndex) + ".png");
+}
+
+void SuperpixelImageWriter::DrawSuperpixelIDs(const Grid<UINT> &superpixelIDs, Bitmap &bmp)
+{
+    //
+    // Colors come from a hash of the ID rather than rand(), which is not safe on the writer thread
+    // and would shift the extractors' random sequence
+    //
     const UINT clusterCount = superpixelIDs.MaxValue() + 1;
     Vector<RGBColor> colors(clusterCount);
-    for(RGBColor &c : colors) c = RGBColor::RandomColor();
-    //ColorGenerator::Generate(colors);
+    for(UINT i = 0; i < clusterCount; i++)
+    {
+        UINT h = (i + 1) * 2654435761u;
+        h ^= h >> 15;
+        colors[i] = RGBColor(h & 0xFF, (h >> 8) & 0xFF, (h >> 16) & 0xFF);
+    }
     bmp.Allocate(superpixelIDs.Cols(), superpixelIDs.Rows());
     for(UINT y = 0; y < bmp.Height(); y++)
     {
@@ -226,15 +831,495 @@ void SuperpixelExtractorSuperpixel::DrawSuperpixelIDs(const Grid<UINT> &superpix
     }
 }
 
-void SuperpixelExtractorSuperpixel::DrawSuperpixelColors(const Bitmap &inputBmp, Bitmap &outputBmp)
+void SuperpixelImageWriter::DrawSuperpixelColors(const Grid<UINT> &superpixelIDs, const Vector<Vec3f> &colors, Bitmap &bmp)
+{
+    bmp.Allocate(superpixelIDs.Cols(), superpixelIDs.Rows());
+    for(UINT y = 0; y < bmp.Height(); y++)
+    {
+        for(UINT x = 0; x < bmp.Width(); x++)
+        {
+            bmp[y][x] = RGBColor(colors[superpixelIDs(y, x)]);
+        }
+    }
+}
+
+Vector<ColorCoordinate> SuperpixelExtractorSLIC::Extract(const AppParameters &parameters, const Bitmap &bmp)
+{
+    Grid<UINT> assignmentsOut;
+    return Extract(parameters, bmp, assignmentsOut);
+}
+
+Vector<ColorCoordinate> SuperpixelExtractorSLIC::Extract(const AppParameters &parameters, const Bitmap &bmp, Grid<UINT> &assignmentsOut)
+{
+    Vector<Superpixel> superpixelsOut;
+    Extract(parameters, bmp, superpixelsOut, assignmentsOut);
+
+    Vector<ColorCoordinate> result;
+    for(const Superpixel &p : superpixelsOut)
+    {
+        result.PushEnd(ColorCoordinate(parameters, RGBColor(p.color), p.seed, bmp.Width(), bmp.Height()));
+    }
+    return result;
+}
+
+void SuperpixelExtractorSLIC::Extract(const AppParameters &parameters, const Bitmap &bmp, Vector<Superpixel> &superpixelsOut, Grid<UINT> &assignmentsOut)
+{
+    ComponentTimer timer( "SLIC segmenting bitmap, " + String(bmp.Width()) + "x" + String(bmp.Height()) );
+
+    _dimensions = Vec2i(bmp.Width(), bmp.Height());
+    _assignments.Allocate(_dimensions.y, _dimensions.x);
+
+    InitializeClusters(parameters, bmp);
+
+    const UINT iterationCount = parameters.superpixelIterations;
+    for(UINT iterationIndex = 0; iterationIndex < iterationCount; iterationIndex++)
+    {
+        if(options.observer != nullptr) options.observer->OnIterationStart(iterationIndex);
+
+        BinClusters();
+        AssignPixels(bmp);
+
+        if(options.observer != nullptr) NotifyObserver(*options.observer, iterationIndex, _assignments, _clusters);
+
+        UpdateClusters(bmp);
+    }
+    BinClusters();
+    AssignPixels(bmp);
+
+    EnforceConnectivity(bmp, superpixelsOut, assignmentsOut);
+}
+
+void SuperpixelExtractorSLIC::InitializeClusters(const AppParameters &parameters, const Bitmap &bmp)
+{
+    const double pixelCount = double(_dimensions.x) * double(_dimensions.y);
+    _gridStep = max((int)sqrt(pixelCount / max(parameters.superpixelCount, 1u)), 1);
+    _cellCount = Vec2i((_dimensions.x + _gridStep - 1) / _gridStep, (_dimensions.y + _gridStep - 1) / _gridStep);
+
+    //
+    // Seed at the cell centers, moved to the lowest color gradient in a 3x3 neighborhood so seeds do not start on an edge
+    //
+    auto gradient = [&](int x, int y)
+    {
+        const int x0 = max(x - 1, 0), x1 = min(x + 1, _dimensions.x - 1);
+        const int y0 = max(y - 1, 0), y1 = min(y + 1, _dimensions.y - 1);
+        return Vec3f::DistSq(Vec3f(bmp[y][x1]), Vec3f(bmp[y][x0])) + Vec3f::DistSq(Vec3f(bmp[y1][x]), Vec3f(bmp[y0][x]));
+    };
+
+    _clusters.Allocate(_cellCount.x * _cellCount.y);
+    for(int cellY = 0; cellY < _cellCount.y; cellY++)
+    {
+        for(int cellX = 0; cellX < _cellCount.x; cellX++)
+        {
+            const Vec2i center(min(cellX * _gridStep + _gridStep / 2, _dimensions.x - 1), min(cellY * _gridStep + _gridStep / 2, _dimensions.y - 1));
+            Vec2i bestCoord = center;
+            float bestGradient = gradient(center.x, center.y);
+            for(int y = max(center.y - 1, 0); y <= min(center.y + 1, _dimensions.y - 1); y++)
+            {
+                for(int x = max(center.x - 1, 0); x <= min(center.x + 1, _dimensions.x - 1); x++)
+                {
+                    const float g = gradient(x, y);
+                    if(g < bestGradient)
+                    {
+                        bestGradient = g;
+                        bestCoord = Vec2i(x, y);
+                    }
+                }
+            }
+
+            Cluster &c = _clusters[cellY * _cellCount.x + cellX];
+            c.center = Vec2f(bestCoord);
+            c.color = Vec3f(bmp[bestCoord.y][bestCoord.x]);
+        }
+    }
+}
+
+void SuperpixelExtractorSLIC::BinClusters()
+{
+    _cells.Allocate(_cellCount.x * _cellCount.y);
+    for(UINT clusterIndex = 0; clusterIndex < _clusters.Length(); clusterIndex++)
+    {
+        const Vec2f &center = _clusters[clusterIndex].center;
+        const int cellX = min(max((int)center.x / _gridStep, 0), _cellCount.x - 1);
+        const int cellY = min(max((int)center.y / _gridStep, 0), _cellCount.y - 1);
+        _cells[cellY * _cellCount.x + cellX].PushEnd(clusterIndex);
+    }
+}
+
+void SuperpixelExtractorSLIC::AssignPixels(const Bitmap &bmp)
+{
+    //
+    // Pixel-centric, so rows are independent and can be assigned in parallel. a center within S of a pixel
+    // always lies in the pixel's cell or one of its 8 neighbors.
+    //
+    const float spatialWeight = options.slicCompactness * options.slicCompactness / float(_gridStep * _gridStep);
+    const float window = (float)_gridStep;
+    ParallelFor(_dimensions.y, options.threadCount, [&](UINT y)
+    {
+        const int cellY = min((int)y / _gridStep, _cellCount.y - 1);
+        for(int x = 0; x < _dimensions.x; x++)
+        {
+            const Vec3f color(bmp[y][x]);
+            const int cellX = min(x / _gridStep, _cellCount.x - 1);
+
+            UINT bestCluster = 0xFFFFFFFF, nearestCluster = 0xFFFFFFFF;
+            float bestDist = numeric_limits<float>::max(), nearestDist = numeric_limits<float>::max();
+            for(int cy = max(cellY - 1, 0); cy <= min(cellY + 1, _cellCount.y - 1); cy++)
+            {
+                for(int cx = max(cellX - 1, 0); cx <= min(cellX + 1, _cellCount.x - 1); cx++)
+                {
+                    for(UINT clusterIndex : _cells[cy * _cellCount.x + cx])
+                    {
+                        const Cluster &c = _clusters[clusterIndex];
+                        const float dx = x - c.center.x;
+                        const float dy = y - c.center.y;
+                        const float dist = Vec3f::DistSq(color, c.color) + (dx * dx + dy * dy) * spatialWeight;
+                        if(fabs(dx) <= window && fabs(dy) <= window && dist < bestDist)
+                        {
+                            bestDist = dist;
+                            bestCluster = clusterIndex;
+                        }
+                        if(dist < nearestDist)
+                        {
+                            nearestDist = dist;
+                            nearestCluster = clusterIndex;
+                        }
+                    }
+                }
+            }
+
+            //
+            // Centers can drift away and leave a pixel uncovered; fall back to the nearest candidate, or all clusters if none are close
+            //
+            if(bestCluster == 0xFFFFFFFF) bestCluster = nearestCluster;
+            if(bestCluster == 0xFFFFFFFF)
+            {
+                for(UINT clusterIndex = 0; clusterIndex < _clusters.Length(); clusterIndex++)
+                {
+                    const float dist = Vec2f::DistSq(Vec2f((float)x, (float)y), _clusters[clusterIndex].center);
+                    if(dist < nearestDist)
+                    {
+                        nearestDist = dist;
+                        bestCluster = clusterIndex;
+                    }
+                }
+            }
+            _assignments(y, x) = bestCluster;
+        }
+    });
+}
+
+void SuperpixelExtractorSLIC::UpdateClusters(const Bitmap &bmp)
+{
+    Vector<Vec3f> colorSums(_clusters.Length());
+    Vector<Vec2f> centerSums(_clusters.Length());
+    Vector<UINT> counts(_clusters.Length());
+    for(UINT i = 0; i < _clusters.Length(); i++)
+    {
+        colorSums[i] = Vec3f::Origin;
+        centerSums[i] = Vec2f::Origin;
+        counts[i] = 0;
+    }
+
+    for(int y = 0; y < _dimensions.y; y++)
+    {
+        for(int x = 0; x < _dimensions.x; x++)
+        {
+            const UINT clusterIndex = _assignments(y, x);
+            colorSums[clusterIndex] += Vec3f(bmp[y][x]);
+            centerSums[clusterIndex] += Vec2f((float)x, (float)y);
+            counts[clusterIndex]++;
+        }
+    }
+
+    for(UINT i = 0; i < _clusters.Length(); i++)
+    {
+        if(counts[i] == 0) continue;
+        _clusters[i].color = colorSums[i] / (float)counts[i];
+        _clusters[i].center = centerSums[i] / (float)counts[i];
+    }
+}
+
+void SuperpixelExtractorSLIC::EnforceConnectivity(const Bitmap &bmp, Vector<Superpixel> &superpixelsOut, Grid<UINT> &assignmentsOut)
+{
+    //
+    // Relabel connected components; fragments smaller than a quarter cell are merged into the component before them in scan order
+    //
+    const UINT minSize = max(_gridStep * _gridStep / 4, 1);
+    assignmentsOut.Allocate(_dimensions.y, _dimensions.x);
+    assignmentsOut.Clear(0xFFFFFFFF);
+
+    const UINT neighborCount = 4;
+    const int XOffsets[neighborCount] = {-1, 1, 0, 0};
+    const int YOffsets[neighborCount] = {0, 0, -1, 1};
+
+    UINT labelCount = 0;
+    Vector<Vec2i> component;
+    for(int y = 0; y < _dimensions.y; y++)
+    {
+        for(int x = 0; x < _dimensions.x; x++)
+        {
+            if(assignmentsOut(y, x) != 0xFFFFFFFF) continue;
+
+            UINT adjacentLabel = 0xFFFFFFFF;
+            if(x > 0) adjacentLabel = assignmentsOut(y, x - 1);
+            else if(y > 0) adjacentLabel = assignmentsOut(y - 1, x);
+
+            const UINT cluster = _assignments(y, x);
+            component.Clear();
+            component.PushEnd(Vec2i(x, y));
+            assignmentsOut(y, x) = labelCount;
+            for(UINT i = 0; i < component.Length(); i++)
+            {
+                const Vec2i coord = component[i];
+                for(UINT neighborIndex = 0; neighborIndex < neighborCount; neighborIndex++)
+                {
+                    Vec2i n(coord.x + XOffsets[neighborIndex], coord.y + YOffsets[neighborIndex]);
+                    if(assignmentsOut.ValidCoordinates(n.y, n.x) && assignmentsOut(n.y, n.x) == 0xFFFFFFFF && _assignments(n.y, n.x) == cluster)
+                    {
+                        assignmentsOut(n.y, n.x) = labelCount;
+                        component.PushEnd(n);
+                    }
+                }
+            }
+
+            if(component.Length() < minSize && adjacentLabel != 0xFFFFFFFF)
+            {
+                for(const Vec2i &coord : component) assignmentsOut(coord.y, coord.x) = adjacentLabel;
+            }
+            else
+            {
+                labelCount++;
+            }
+        }
+    }
+
+    superpixelsOut.Allocate(labelCount);
+    for(int y = 0; y < _dimensions.y; y++)
+    {
+        for(int x = 0; x < _dimensions.x; x++)
+        {
+            superpixelsOut[assignmentsOut(y, x)].AddCoord(bmp, Vec2i(x, y));
+        }
+    }
+    for(Superpixel &p : superpixelsOut)
+    {
+        p.ComputeColor(bmp);
+        p.seed = p.MassCentroid();
+    }
+}
+
+Vec2i SuperpixelBitmapTileSource::Dimensions() const
+{
+    return Vec2i(_bmp.Width(), _bmp.Height());
+}
+
+void SuperpixelBitmapTileSource::ReadTile(const Vec2i &origin, Bitmap &tile)
+{
+    for(UINT y = 0; y < tile.Height(); y++)
+    {
+        memcpy(&tile[y][0], &_bmp[origin.y + y][origin.x], tile.Width() * sizeof(RGBColor));
+    }
+}
+
+SuperpixelRawFileTileSource::SuperpixelRawFileTileSource()
+{
+    _pixels = nullptr;
+    _dimensions = Vec2i(0, 0);
+    _mappedSize = 0;
+#if defined(_WIN32)
+    _file = INVALID_HANDLE_VALUE;
+    _mapping = nullptr;
+#endif
+}
+
+SuperpixelRawFileTileSource::~SuperpixelRawFileTileSource()
+{
+    Close();
+}
+
+bool SuperpixelRawFileTileSource::Open(const String &filename, UINT width, UINT height)
+{
+    Close();
+    const size_t expectedSize = size_t(width) * size_t(height) * sizeof(RGBColor);
+#if defined(_WIN32)
+    _file = CreateFileA(filename.CString(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, nullptr);
+    LARGE_INTEGER fileSize;
+    if(_file == INVALID_HANDLE_VALUE || !GetFileSizeEx(_file, &fileSize) || size_t(fileSize.QuadPart) < expectedSize)
+    {
+        Console::WriteLine("Could not open " + filename);
+        Close();
+        return false;
+    }
+    _mapping = CreateFileMappingA(_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    void *data = _mapping == nullptr ? nullptr : MapViewOfFile(_mapping, FILE_MAP_READ, 0, 0, 0);
+    if(data == nullptr)
+    {
+        Console::WriteLine("Could not map " + filename);
+        Close();
+        return false;
+    }
+#else
+    int fd = open(filename.CString(), O_RDONLY);
+    struct stat st;
+    if(fd < 0 || fstat(fd, &st) != 0 || size_t(st.st_size) < expectedSize)
+    {
+        if(fd >= 0) close(fd);
+        Console::WriteLine("Could not open " + filename);
+        return false;
+    }
+    void *data = mmap(nullptr, expectedSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(data == MAP_FAILED)
+    {
+        Console::WriteLine("Could not map " + filename);
+        return false;
+    }
+#endif
+    _pixels = (const RGBColor *)data;
+    _dimensions = Vec2i(width, height);
+    _mappedSize = expectedSize;
+    return true;
+}
+
+void SuperpixelRawFileTileSource::Close()
+{
+#if defined(_WIN32)
+    if(_pixels != nullptr) UnmapViewOfFile(_pixels);
+    if(_mapping != nullptr) CloseHandle(_mapping);
+    if(_file != INVALID_HANDLE_VALUE) CloseHandle(_file);
+    _file = INVALID_HANDLE_VALUE;
+    _mapping = nullptr;
+#else
+    if(_pixels != nullptr) munmap((void *)_pixels, _mappedSize);
+#endif
+    _pixels = nullptr;
+    _dimensions = Vec2i(0, 0);
+    _mappedSize = 0;
+}
+
+Vec2i SuperpixelRawFileTileSource::Dimensions() const
+{
+    return _dimensions;
+}
+
+void SuperpixelRawFileTileSource::ReadTile(const Vec2i &origin, Bitmap &tile)
+{
+    for(UINT y = 0; y < tile.Height(); y++)
+    {
+        memcpy(&tile[y][0], _pixels + size_t(origin.y + y) * _dimensions.x + origin.x, tile.Width() * sizeof(RGBColor));
+    }
+}
+
+void SuperpixelExtractorStreaming::Extract(const AppParameters &parameters, SuperpixelTileSource &source, UINT *assignmentsOut, size_t assignmentsStride, Vector<ColorCoordinate> &superpixelsOut)
 {
-    outputBmp.Allocate(_assignments.Cols(), _assignments.Rows());
-    for(UINT y = 0; y < outputBmp.Height(); y++)
+    const Vec2i dimensions = source.Dimensions();
+    ComponentTimer timer( "Streaming segmentation, " + String(dimensions.x) + "x" + String(dimensions.y) );
+
+    const int tileSize = max((int)options.streamTileSize, 1);
+    const int overlap = (int)options.streamOverlap;
+    const double pixelsPerSuperpixel = double(dimensions.x) * double(dimensions.y) / max(parameters.superpixelCount, 1u);
+
+    SuperpixelExtractorSLIC extractor;
+    extractor.options = options;
+
+    _accumulators.Clear();
+    Bitmap tile;
+    Vector<Superpixel> tileSuperpixels;
+    Grid<UINT> tileAssignments;
+    Vector<UINT> globalLabels;
+    map<UINT, UINT> votes;
+
+    for(int coreY = 0; coreY < dimensions.y; coreY += tileSize)
     {
-        for(UINT x = 0; x < outputBmp.Width(); x++)
+        for(int coreX = 0; coreX < dimensions.x; coreX += tileSize)
         {
-            const Superpixel &p =  _superpixels[_assignments(y, x)];
-            outputBmp[y][x] = RGBColor(p.color);
+            const Vec2i coreMin(coreX, coreY);
+            const Vec2i coreMax(min(coreX + tileSize, dimensions.x), min(coreY + tileSize, dimensions.y));
+            const Vec2i tileMin(max(coreMin.x - overlap, 0), max(coreMin.y - overlap, 0));
+            const Vec2i tileMax(min(coreMax.x + overlap, dimensions.x), min(coreMax.y + overlap, dimensions.y));
+
+            tile.Allocate(tileMax.x - tileMin.x, tileMax.y - tileMin.y);
+            source.ReadTile(tileMin, tile);
+
+            AppParameters tileParameters = parameters;
+            tileParameters.superpixelCount = max((UINT)(tile.Width() * tile.Height() / pixelsPerSuperpixel + 0.5), 1u);
+            extractor.Extract(tileParameters, tile, tileSuperpixels, tileAssignments);
+
+            //
+            // Match each tile superpixel against the labels already written in the margin: rows above
+            // this tile row, and columns left of this tile within it
+            //
+            globalLabels.Allocate(tileSuperpixels.Length());
+            for(UINT localLabel = 0; localLabel < tileSuperpixels.Length(); localLabel++)
+            {
+                votes.clear();
+                UINT writtenCount = 0;
+                for(const Vec2i &p : tileSuperpixels[localLabel].pixels)
+                {
+                    const Vec2i coord = p + tileMin;
+                    const bool written = coord.y < coreMin.y || (coord.y < coreMax.y && coord.x < coreMin.x);
+                    if(!written) continue;
+                    writtenCount++;
+                    votes[assignmentsOut[coord.y * assignmentsStride + coord.x]]++;
+                }
+
+                UINT bestLabel = 0xFFFFFFFF, bestVotes = 0;
+                for(const auto &v : votes)
+                {
+                    if(v.second > bestVotes)
+                    {
+                        bestVotes = v.second;
+                        bestLabel = v.first;
+                    }
+                }
+
+                //
+                // New superpixels get a global label at their first core pixel, so one that only covers
+                // the margin never produces an empty entry in superpixelsOut
+                //
+                globalLabels[localLabel] = (bestLabel != 0xFFFFFFFF && bestVotes * 2 >= writtenCount) ? bestLabel : 0xFFFFFFFF;
+            }
+
+            //
+            // Only the core is written; the margin belongs to the neighboring tiles
+            //
+            for(int y = coreMin.y; y < coreMax.y; y++)
+            {
+                UINT *row = assignmentsOut + y * assignmentsStride;
+                for(int x = coreMin.x; x < coreMax.x; x++)
+                {
+                    UINT &globalLabel = globalLabels[tileAssignments(y - tileMin.y, x - tileMin.x)];
+                    if(globalLabel == 0xFFFFFFFF)
+                    {
+                        globalLabel = _accumulators.Length();
+                        Accumulator a;
+                        a.colorSum[0] = a.colorSum[1] = a.colorSum[2] = 0.0;
+                        a.coordSum[0] = a.coordSum[1] = 0.0;
+                        a.count = 0;
+                        _accumulators.PushEnd(a);
+                    }
+                    const UINT label = globalLabel;
+                    row[x] = label;
+
+                    const RGBColor &c = tile[y - tileMin.y][x - tileMin.x];
+                    Accumulator &a = _accumulators[label];
+                    a.colorSum[0] += c.r;
+                    a.colorSum[1] += c.g;
+                    a.colorSum[2] += c.b;
+                    a.coordSum[0] += x;
+                    a.coordSum[1] += y;
+                    a.count++;
+                }
+            }
         }
     }
+
+    superpixelsOut.Clear();
+    for(const Accumulator &a : _accumulators)
+    {
+        const double scale = 1.0 / (255.0 * a.count);
+        const Vec3f color(float(a.colorSum[0] * scale), float(a.colorSum[1] * scale), float(a.colorSum[2] * scale));
+        const Vec2i centroid((int)(a.coordSum[0] / a.count + 0.5), (int)(a.coordSum[1] / a.count + 0.5));
+        superpixelsOut.PushEnd(ColorCoordinate(parameters, RGBColor(color), centroid, dimensions.x, dimensions.y));
+    }
 }
@@ -1,3 +1,11 @@
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+
+#include "SuperpixelTarget.h"
+
 struct ColorCoordinate
 {
     ColorCoordinate()
@@ -25,22 +33,272 @@ private:
     }
 };
 
+//
+// the same five features as ColorCoordinate::features for many samples, one contiguous array per
+// feature (r, g, b, x, y). storage only grows, so extracting into the same object again does not allocate.
+//
+struct ColorCoordinateFeatures
+{
+    ColorCoordinateFeatures()
+    {
+        count = 0;
+    }
+
+    void Allocate(UINT sampleCount)
+    {
+        if(channels[0].Length() < sampleCount)
+        {
+            for(Vector<float> &c : channels) c.Allocate(sampleCount);
+        }
+        count = sampleCount;
+    }
+
+    float* Channel(UINT featureIndex)
+    {
+        return channels[featureIndex].CArray();
+    }
+    const float* Channel(UINT featureIndex) const
+    {
+        return channels[featureIndex].CArray();
+    }
+
+    Vector<float> channels[5];
+    UINT count;
+};
+
 class SuperpixelExtractorPeriodic
 {
 public:
 	Vector<ColorCoordinate> Extract(const AppParameters &parameters, const Bitmap &bmp);
+
+    // samples the same pixels as Extract, converting four pixels at a time with SSE2 where available
+    void ExtractFeatures(const AppParameters &parameters, const Bitmap &bmp, ColorCoordinateFeatures &featuresOut);
 };
 
+//
+// k-d tree over 5-D superpixel features, for nearest color / position lookups. queries are laid out
+// like ColorCoordinate::features. weights, when given, scales each squared feature difference, so
+// { 1, 1, 1, 0, 0 } searches by color only and { 0, 0, 0, 1, 1 } by position only.
+//
+class SuperpixelFeatureIndex
+{
+public:
+    static const UINT dimension = 5;
+
+    void Build(const Vector<ColorCoordinate> &superpixels);
+    void Build(const ColorCoordinateFeatures &features);
+
+    //
+    // for every query writes the indices of its k nearest features, nearest first, to resultsOut[queryIndex * k].
+    // entries past the number of features are 0xFFFFFFFF. queries run in parallel.
+    //
+    void KNearest(const float *queries, UINT queryCount, UINT k, UINT *resultsOut, const float *weights = nullptr) const;
+
+    // indices of every feature within radius of each query, in no particular order
+    void WithinRadius(const float *queries, UINT queryCount, float radius, Vector< Vector<UINT> > &resultsOut, const float *weights = nullptr) const;
+
+    UINT Length() const
+    {
+        return _indices.Length();
+    }
+
+private:
+    struct Node
+    {
+        UINT begin, end;
+        int left, right;
+        UINT splitDimension;
+        float splitValue;
+    };
+
+    int BuildNode(UINT begin, UINT end);
+    void SearchKNearest(int nodeIndex, const float *query, const float *weights, UINT k, UINT &found, float *bestDistances, UINT *bestIndices) const;
+    void SearchRadius(int nodeIndex, const float *query, const float *weights, float radiusSq, Vector<UINT> &result) const;
+    float DistSq(const float *query, UINT point, const float *weights) const;
+
+    // features reordered by tree position, dimension floats per point
+    Vector<float> _points;
+
+    // original feature index of each reordered point
+    Vector<UINT> _indices;
+    Vector<Node> _nodes;
+};
+
+enum class SuperpixelQueueType
+{
+    binaryHeap,
+    bucket,
+};
+
+//
+// counter-based generator: draw i is a SplitMix64 hash of (seed, i). there is no shared state, so every
+// extractor can own one and runs are reproducible from the seed alone.
+//
+class SuperpixelRandom
+{
+public:
+    SuperpixelRandom(UINT64 seed = 0)
+    {
+        _seed = Mix(seed);
+        _counter = 0;
+    }
+
+    static UINT64 Mix(UINT64 z)
+    {
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        return z ^ (z >> 31);
+    }
+
+    // draw index of the stream, independent of how many draws were taken before
+    UINT64 At(UINT64 index) const
+    {
+        return Mix(_seed + (index + 1) * 0x9E3779B97F4A7C15ULL);
+    }
+
+    UINT64 Next()
+    {
+        return At(_counter++);
+    }
+
+    // uniform in [0, n)
+    UINT Uniform(UINT n)
+    {
+        return (UINT)(((Next() >> 32) * n) >> 32);
+    }
+
+private:
+    UINT64 _seed;
+    UINT64 _counter;
+};
+
+class SuperpixelObserver;
+
+struct SuperpixelExtractorOptions
+{
+    SuperpixelExtractorOptions()
+    {
+        observer = nullptr;
+        seed = 0;
+        tiledGrowth = false;
+        tileSize = 256;
+        threadCount = 0;
+        queueType = SuperpixelQueueType::binaryHeap;
+        bucketCount = 4096;
+        slicCompactness = 0.1f;
+        streamTileSize = 2048;
+        streamOverlap = 64;
+    }
+
+    //
+    // tiled growth floods each tile from its own seeds in parallel, then resolves the tile borders
+    // with one serial pass. assignments depend only on the seeds and tileSize, not on threadCount.
+    //
+    bool tiledGrowth;
+    UINT tileSize;
+
+    // 0 uses every hardware thread
+    UINT threadCount;
+
+    //
+    // the bucket queue quantizes the assignment error into bucketCount levels. push is O(1); pop scans up
+    // from the lowest non-empty level, which a push can move back down, so a single pop may walk up to
+    // bucketCount levels. entries within one level pop in LIFO order instead of strict priority order.
+    //
+    SuperpixelQueueType queueType;
+    UINT bucketCount;
+
+    // weight of the spatial term against RGB distance (channels in [0, 1]) in SuperpixelExtractorSLIC
+    float slicCompactness;
+
+    // not owned. when nullptr the extractors do no tracing work at all.
+    SuperpixelObserver *observer;
+
+    // every Extract call restarts the extractor's SuperpixelRandom from this seed
+    UINT64 seed;
+
+    // tile core size and the margin read around it by SuperpixelExtractorStreaming
+    UINT streamTileSize;
+    UINT streamOverlap;
+};
+
+//
+// receives intermediate state from the superpixel extractors, for debugging and visualization.
+// colors holds the current mean color of every label in assignments.
+//
+class SuperpixelObserver
+{
+public:
+    virtual ~SuperpixelObserver() {}
+    virtual void OnIterationStart(UINT iterationIndex) {}
+    virtual void OnIteration(UINT iterationIndex, const Grid<UINT> &assignments, const Vector<Vec3f> &colors) {}
+};
+
+//
+// writes clustersIteration*.png and colorsIteration*.png for every iteration. in async mode the
+// state is copied and drawing and PNG encoding happen on a background thread.
+//
+class SuperpixelImageWriter : public SuperpixelObserver
+{
+public:
+    SuperpixelImageWriter(bool async = true);
+    ~SuperpixelImageWriter();
+
+    void OnIterationStart(UINT iterationIndex);
+    void OnIteration(UINT iterationIndex, const Grid<UINT> &assignments, const Vector<Vec3f> &colors);
+
+    // blocks until every queued image has been written
+    void Flush();
+
+    static void DrawSuperpixelIDs(const Grid<UINT> &superpixelIDs, Bitmap &bmp);
+    static void DrawSuperpixelColors(const Grid<UINT> &superpixelIDs, const Vector<Vec3f> &colors, Bitmap &bmp);
+
+private:
+    struct Job
+    {
+        UINT iterationIndex;
+        Grid<UINT> assignments;
+        Vector<Vec3f> colors;
+    };
+
+    static void Write(const Job &job);
+    void WriterThread();
+
+    bool _async;
+    thread _thread;
+    mutex _mutex;
+    condition_variable _wake, _idle;
+    deque<Job> _jobs;
+    bool _busy;
+    bool _stop;
+};
+
+//
+// colorSum and coordSum are kept up to date by AddCoord, so the mean color and centroid cost O(1).
+// pixels keeps its storage across Reset calls.
+//
 struct Superpixel
 {
+    Superpixel()
+    {
+        ClearSums();
+    }
+
     void Reset(const Bitmap &bmp, const Vec2i &seed);
 
     Vec2i MassCentroid() const;
+    Vec2f Centroid() const;
     double AssignmentError(const Bitmap &bmp, const Vec2i &coord) const;
     
-    __forceinline void AddCoord(const Vec2i &coord)
+    __forceinline void AddCoord(const Bitmap &bmp, const Vec2i &coord)
     {
         pixels.PushEnd(coord);
+        const RGBColor &c = bmp[coord.y][coord.x];
+        colorSum[0] += c.r;
+        colorSum[1] += c.g;
+        colorSum[2] += c.b;
+        coordSum[0] += coord.x;
+        coordSum[1] += coord.y;
     }
     void ResetColor( const RGBColor &_color );
     void ComputeColor( const Bitmap &bmp );
@@ -48,6 +306,16 @@ struct Superpixel
     Vec3f color;
     Vector<Vec2i> pixels;
     Vec2i seed;
+
+    double colorSum[3];
+    double coordSum[2];
+
+private:
+    void ClearSums()
+    {
+        colorSum[0] = colorSum[1] = colorSum[2] = 0.0;
+        coordSum[0] = coordSum[1] = 0.0;
+    }
 };
 
 
@@ -62,21 +330,50 @@ public:
         UINT superpixelIndex;
     };
 
+    class Queue
+    {
+    public:
+        void Init(SuperpixelQueueType type, UINT bucketCount);
+        void Push(const QueueEntry &entry);
+        QueueEntry Pop();
+        bool Empty() const
+        {
+            return _size == 0;
+        }
+
+    private:
+        UINT BucketIndex(double priority) const;
+
+        SuperpixelQueueType _type;
+        priority_queue<QueueEntry> _heap;
+        vector< vector<QueueEntry> > _buckets;
+        UINT _minBucket;
+        size_t _size;
+    };
+
     Vector<ColorCoordinate> Extract(const AppParameters &parameters, const Bitmap &bmp);
 	Vector<ColorCoordinate> Extract(const AppParameters &parameters, const Bitmap &bmp, Grid<UINT> &assignmentsOut);
     void Extract(const AppParameters &parameters, const Bitmap &bmp, Vector<Superpixel> &superpixelsOut, Grid<UINT> &assignmentsOut);
 
+    //
+    // one solver target per superpixel. superpixels whose color variance exceeds maxVariance are split back
+    // into per-pixel targets, so 0 reproduces the per-pixel problem and a large value compresses the most.
+    //
+    static void MakeTargets(const Bitmap &bmp, const Vector<Superpixel> &superpixels, double maxVariance, vector<SuperpixelTarget> &targetsOut);
+
+    SuperpixelExtractorOptions options;
+
 private:
     void InitializeSuperpixels(const AppParameters &parameters, const Bitmap &bmp);
     void AssignPixel(const AppParameters &parameters, const Bitmap &bmp, const Vec2i &coord, UINT clusterIndex);
     void GrowSuperpixels(const AppParameters &parameters, const Bitmap &bmp);
+    void GrowSuperpixelsTiled(const AppParameters &parameters, const Bitmap &bmp);
+    void GrowTile(const Bitmap &bmp, const Vec2i &tileMin, const Vec2i &tileMax, const Vector<UINT> &tileSuperpixels, Vector<QueueEntry> &borderEntries);
     void RecenterSuperpixels(const AppParameters &parameters, const Bitmap &bmp);
-    
-    static void DrawSuperpixelIDs(const Grid<UINT> &superpixelIDs, Bitmap &bmp);
-    void DrawSuperpixelColors(const Bitmap &inputBmp, Bitmap &outputBmp);
 
     Vector<Superpixel> _superpixels;
-    priority_queue<QueueEntry> _queue;
+    SuperpixelRandom _random;
+    Queue _queue;
     Grid<UINT> _assignments;
     Vec2i _dimensions;
 };
@@ -85,3 +382,122 @@ __forceinline bool operator < (const SuperpixelExtractorSuperpixel::QueueEntry &
 {
     return (a.priority < b.priority);
 }
+
+//
+// SLIC: superpixels start on a regular grid with spacing S and each pixel only considers the
+// centers whose 2S x 2S window covers it, so an iteration is linear in the pixel count no matter
+// how many superpixels are requested. the superpixel count is rounded to fit the grid.
+//
+class SuperpixelExtractorSLIC
+{
+public:
+    Vector<ColorCoordinate> Extract(const AppParameters &parameters, const Bitmap &bmp);
+    Vector<ColorCoordinate> Extract(const AppParameters &parameters, const Bitmap &bmp, Grid<UINT> &assignmentsOut);
+    void Extract(const AppParameters &parameters, const Bitmap &bmp, Vector<Superpixel> &superpixelsOut, Grid<UINT> &assignmentsOut);
+
+    SuperpixelExtractorOptions options;
+
+private:
+    struct Cluster
+    {
+        Vec3f color;
+        Vec2f center;
+    };
+
+    void InitializeClusters(const AppParameters &parameters, const Bitmap &bmp);
+    void BinClusters();
+    void AssignPixels(const Bitmap &bmp);
+    void UpdateClusters(const Bitmap &bmp);
+    void EnforceConnectivity(const Bitmap &bmp, Vector<Superpixel> &superpixelsOut, Grid<UINT> &assignmentsOut);
+
+    Vector<Cluster> _clusters;
+
+    // cluster indices by the grid cell their center lies in
+    Vector< Vector<UINT> > _cells;
+    Vec2i _cellCount;
+    int _gridStep;
+
+    Grid<UINT> _assignments;
+    Vec2i _dimensions;
+};
+
+//
+// supplies an image one rectangle at a time, so the whole image never has to be in memory
+//
+class SuperpixelTileSource
+{
+public:
+    virtual ~SuperpixelTileSource() {}
+    virtual Vec2i Dimensions() const = 0;
+
+    // fills tile, already allocated to the requested size, with the pixels starting at origin
+    virtual void ReadTile(const Vec2i &origin, Bitmap &tile) = 0;
+};
+
+class SuperpixelBitmapTileSource : public SuperpixelTileSource
+{
+public:
+    SuperpixelBitmapTileSource(const Bitmap &bmp) : _bmp(bmp) {}
+    Vec2i Dimensions() const;
+    void ReadTile(const Vec2i &origin, Bitmap &tile);
+
+private:
+    const Bitmap &_bmp;
+};
+
+//
+// memory-mapped raw file of width * height RGBColor values, row-major with no header.
+// pages are only touched when a tile reads them.
+//
+class SuperpixelRawFileTileSource : public SuperpixelTileSource
+{
+public:
+    SuperpixelRawFileTileSource();
+    ~SuperpixelRawFileTileSource();
+
+    // returns false and prints the reason if the file cannot be mapped or is too small
+    bool Open(const String &filename, UINT width, UINT height);
+    void Close();
+
+    Vec2i Dimensions() const;
+    void ReadTile(const Vec2i &origin, Bitmap &tile);
+
+private:
+    SuperpixelRawFileTileSource(const SuperpixelRawFileTileSource &);
+    SuperpixelRawFileTileSource& operator = (const SuperpixelRawFileTileSource &);
+
+    const RGBColor *_pixels;
+    Vec2i _dimensions;
+    size_t _mappedSize;
+#if defined(_WIN32)
+    void *_file;
+    void *_mapping;
+#endif
+};
+
+//
+// segments each tile, plus an overlap margin, with SuperpixelExtractorSLIC. a tile superpixel that mostly
+// covers already-written pixels in the margin continues that superpixel instead of starting a new one.
+// memory is bounded by the tile size plus O(1) per superpixel.
+//
+class SuperpixelExtractorStreaming
+{
+public:
+    //
+    // assignmentsOut must hold Dimensions().y rows of assignmentsStride UINTs. superpixelsOut receives
+    // the mean color and rounded centroid of every superpixel.
+    //
+    void Extract(const AppParameters &parameters, SuperpixelTileSource &source, UINT *assignmentsOut, size_t assignmentsStride, Vector<ColorCoordinate> &superpixelsOut);
+
+    SuperpixelExtractorOptions options;
+
+private:
+    struct Accumulator
+    {
+        double colorSum[3];
+        double coordSum[2];
+        UINT64 count;
+    };
+
+    Vector<Accumulator> _accumulators;
+};
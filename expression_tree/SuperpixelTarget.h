@@ -0,0 +1,35 @@
+#pragma once
+
+//
+// a weighted fit target for the solver. no mLib types, so it can be shared between the superpixel
+// extractor and the ceres side.
+//
+// a per-pixel target has weight 1. a superpixel target stands in for all n of its pixels: with the
+// model constant over the superpixel, sum_i (c_i - m)^2 = n (mean - m)^2 + const, so weighting the
+// residual by sqrt(n) leaves the optimum unchanged while the problem shrinks by a factor of n.
+//
+struct SuperpixelTarget
+{
+	static SuperpixelTarget pixel(double r, double g, double b, int x, int y)
+	{
+		SuperpixelTarget target;
+		target.color[0] = r;
+		target.color[1] = g;
+		target.color[2] = b;
+		target.weight = 1.0;
+		target.pixelCount = 1;
+		target.x = x;
+		target.y = y;
+		return target;
+	}
+
+	// mean color, channels in [0, 1]
+	double color[3];
+
+	// residual scale, sqrt(pixelCount) for superpixels
+	double weight;
+	int pixelCount;
+
+	// representative pixel, used to look up per-pixel layer values
+	int x, y;
+};
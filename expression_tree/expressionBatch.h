@@ -0,0 +1,259 @@
+#pragma once
+
+//
+// evaluates an ExpProgram over many parameter sets at once. every step is run across
+// all lanes before moving on, so the arithmetic ops map onto SIMD kernels.
+//
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#define EXP_BATCH_AVX
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define EXP_BATCH_SSE2
+#endif
+
+namespace ExpBatchKernels
+{
+#if defined(EXP_BATCH_AVX)
+	typedef __m256d Vec;
+	static const int VecWidth = 4;
+	inline Vec load(const double *p) { return _mm256_loadu_pd(p); }
+	inline void store(double *p, Vec v) { _mm256_storeu_pd(p, v); }
+	inline Vec add(Vec a, Vec b) { return _mm256_add_pd(a, b); }
+	inline Vec subtract(Vec a, Vec b) { return _mm256_sub_pd(a, b); }
+	inline Vec multiply(Vec a, Vec b) { return _mm256_mul_pd(a, b); }
+	inline Vec divide(Vec a, Vec b) { return _mm256_div_pd(a, b); }
+	inline Vec negate(Vec a) { return _mm256_xor_pd(a, _mm256_set1_pd(-0.0)); }
+	inline Vec sqrt(Vec a) { return _mm256_sqrt_pd(a); }
+#elif defined(EXP_BATCH_SSE2)
+	typedef __m128d Vec;
+	static const int VecWidth = 2;
+	inline Vec load(const double *p) { return _mm_loadu_pd(p); }
+	inline void store(double *p, Vec v) { _mm_storeu_pd(p, v); }
+	inline Vec add(Vec a, Vec b) { return _mm_add_pd(a, b); }
+	inline Vec subtract(Vec a, Vec b) { return _mm_sub_pd(a, b); }
+	inline Vec multiply(Vec a, Vec b) { return _mm_mul_pd(a, b); }
+	inline Vec divide(Vec a, Vec b) { return _mm_div_pd(a, b); }
+	inline Vec negate(Vec a) { return _mm_xor_pd(a, _mm_set1_pd(-0.0)); }
+	inline Vec sqrt(Vec a) { return _mm_sqrt_pd(a); }
+#endif
+
+	struct AddOp
+	{
+		static double scalar(double a, double b) { return a + b; }
+#if defined(EXP_BATCH_AVX) || defined(EXP_BATCH_SSE2)
+		static Vec simd(Vec a, Vec b) { return add(a, b); }
+#endif
+	};
+
+	struct SubtractOp
+	{
+		static double scalar(double a, double b) { return a - b; }
+#if defined(EXP_BATCH_AVX) || defined(EXP_BATCH_SSE2)
+		static Vec simd(Vec a, Vec b) { return subtract(a, b); }
+#endif
+	};
+
+	struct MultiplyOp
+	{
+		static double scalar(double a, double b) { return a * b; }
+#if defined(EXP_BATCH_AVX) || defined(EXP_BATCH_SSE2)
+		static Vec simd(Vec a, Vec b) { return multiply(a, b); }
+#endif
+	};
+
+	struct DivideOp
+	{
+		static double scalar(double a, double b) { return a / b; }
+#if defined(EXP_BATCH_AVX) || defined(EXP_BATCH_SSE2)
+		static Vec simd(Vec a, Vec b) { return divide(a, b); }
+#endif
+	};
+
+	struct NegateOp
+	{
+		static double scalar(double a) { return -a; }
+#if defined(EXP_BATCH_AVX) || defined(EXP_BATCH_SSE2)
+		static Vec simd(Vec a) { return negate(a); }
+#endif
+	};
+
+	struct SqrtOp
+	{
+		static double scalar(double a) { return std::sqrt(a); }
+#if defined(EXP_BATCH_AVX) || defined(EXP_BATCH_SSE2)
+		static Vec simd(Vec a) { return sqrt(a); }
+#endif
+	};
+
+	template<class Op>
+	inline void binary(const double *a, const double *b, double *out, int n)
+	{
+		int i = 0;
+#if defined(EXP_BATCH_AVX) || defined(EXP_BATCH_SSE2)
+		for (; i + VecWidth <= n; i += VecWidth)
+			store(out + i, Op::simd(load(a + i), load(b + i)));
+#endif
+		for (; i < n; i++)
+			out[i] = Op::scalar(a[i], b[i]);
+	}
+
+	template<class Op>
+	inline void unary(const double *a, double *out, int n)
+	{
+		int i = 0;
+#if defined(EXP_BATCH_AVX) || defined(EXP_BATCH_SSE2)
+		for (; i + VecWidth <= n; i += VecWidth)
+			store(out + i, Op::simd(load(a + i)));
+#endif
+		for (; i < n; i++)
+			out[i] = Op::scalar(a[i]);
+	}
+
+	// no vector transcendentals available, these stay scalar
+	inline void sin(const double *a, double *out, int n) { for (int i = 0; i < n; i++) out[i] = std::sin(a[i]); }
+	inline void cos(const double *a, double *out, int n) { for (int i = 0; i < n; i++) out[i] = std::cos(a[i]); }
+	inline void tan(const double *a, double *out, int n) { for (int i = 0; i < n; i++) out[i] = std::tan(a[i]); }
+	inline void pow(const double *a, const double *b, double *out, int n) { for (int i = 0; i < n; i++) out[i] = std::pow(a[i], b[i]); }
+
+	inline void fill(double value, double *out, int n) { for (int i = 0; i < n; i++) out[i] = value; }
+	inline void copy(const double *a, double *out, int n) { memcpy(out, a, sizeof(double) * n); }
+}
+
+struct ExpBatchEvaluator
+{
+	// lanes are processed in chunks of this size so the value buffer stays in cache
+	static const int defaultChunkSize = 64;
+
+	ExpBatchEvaluator()
+	{
+		program = nullptr;
+		chunkSize = defaultChunkSize;
+	}
+
+	explicit ExpBatchEvaluator(const ExpProgram &_program, int _chunkSize = defaultChunkSize)
+	{
+		program = &_program;
+		chunkSize = _chunkSize;
+	}
+
+	// all arrays are SoA: paramsA[paramIndex * laneCount + lane], paramsB[paramIndex * laneCount + lane]
+	// and results[resultIndex * laneCount + lane].
+	void eval(int laneCount, const double *paramsA, const double *paramsB, double *results)
+	{
+		const int rowCount = program->registerCount + program->resultCount;
+		values.resize((size_t)rowCount * chunkSize);
+		functionParams.resize((size_t)program->maxCallParams * chunkSize);
+		functionResults.resize((size_t)program->functionResultCount * chunkSize);
+
+		for (int laneStart = 0; laneStart < laneCount; laneStart += chunkSize)
+		{
+			const int n = min(chunkSize, laneCount - laneStart);
+			evalChunk(laneCount, laneStart, n, paramsA, paramsB);
+
+			for (int r = 0; r < program->resultCount; r++)
+			{
+				double *out = results + (size_t)r * laneCount + laneStart;
+				if (program->resultSteps[r] == -1)
+					ExpBatchKernels::fill(0.0, out, n);
+				else
+					ExpBatchKernels::copy(row(program->registerCount + r), out, n);
+			}
+		}
+	}
+
+	const ExpProgram *program;
+	int chunkSize;
+
+	// values[row * chunkSize + lane] for the chunk currently being evaluated. rows are the
+	// program's registers followed by its result area, see ExpProgram::compact.
+	vector<double> values;
+
+	// SoA scratch for native function calls, lane stride is the current chunk width
+	vector<double> functionParams;
+	vector<double> functionResults;
+	vector<double> laneParams;
+	vector<double> laneResults;
+
+private:
+	double* row(int index)
+	{
+		return values.data() + (size_t)index * chunkSize;
+	}
+
+	double* functionResult(int resultOffset, int outputIndex, int n)
+	{
+		return functionResults.data() + (size_t)resultOffset * chunkSize + (size_t)outputIndex * n;
+	}
+
+	// uses the batched binding when there is one, otherwise calls the scalar binding per lane
+	void callFunction(const ExpCallSite &site, int n)
+	{
+		double *results = functionResult(site.resultOffset, 0, n);
+		const ExpNativeFunction &native = program->nativeFunctions[site.functionIndex];
+		const ExpNativeBatchFunction &nativeBatch = program->nativeBatchFunctions[site.functionIndex];
+		if (!native && !nativeBatch)
+		{
+			ExpBatchKernels::fill(0.0, results, site.resultCount * n);
+			return;
+		}
+
+		const int *paramRows = program->compactCallParams.data() + site.paramOffset;
+		for (int p = 0; p < site.paramCount; p++)
+			ExpBatchKernels::copy(row(paramRows[p]), functionParams.data() + (size_t)p * n, n);
+
+		if (nativeBatch)
+		{
+			nativeBatch(n, functionParams.data(), results);
+			return;
+		}
+
+		laneParams.resize(site.paramCount);
+		laneResults.resize(site.resultCount);
+		for (int lane = 0; lane < n; lane++)
+		{
+			for (int p = 0; p < site.paramCount; p++)
+				laneParams[p] = functionParams[(size_t)p * n + lane];
+			native(laneParams.data(), laneResults.data());
+			for (int r = 0; r < site.resultCount; r++)
+				results[(size_t)r * n + lane] = laneResults[r];
+		}
+	}
+
+	void evalChunk(int laneCount, int laneStart, int n, const double *paramsA, const double *paramsB)
+	{
+		const vector<ExpInstruction> &code = program->compactCode;
+		for (int i = 0; i < (int)code.size(); i++)
+		{
+			const ExpInstruction &inst = code[i];
+			double *out = row(program->compactDestinations[i]);
+			switch (inst.opcode)
+			{
+			case ExpOpcode::constant: ExpBatchKernels::fill(program->constants[inst.operand0], out, n); break;
+			case ExpOpcode::paramA: ExpBatchKernels::copy(paramsA + (size_t)inst.operand0 * laneCount + laneStart, out, n); break;
+			case ExpOpcode::paramB: ExpBatchKernels::copy(paramsB + (size_t)inst.operand0 * laneCount + laneStart, out, n); break;
+			case ExpOpcode::result: ExpBatchKernels::copy(row(inst.operand0), out, n); break;
+			case ExpOpcode::functionCall: callFunction(program->callSites[inst.operand0], n); ExpBatchKernels::fill(0.0, out, n); break;
+			case ExpOpcode::functionOutput: ExpBatchKernels::copy(functionResult(inst.operand0 - inst.operand1, inst.operand1, n), out, n); break;
+
+			case ExpOpcode::sin: ExpBatchKernels::sin(row(inst.operand0), out, n); break;
+			case ExpOpcode::cos: ExpBatchKernels::cos(row(inst.operand0), out, n); break;
+			case ExpOpcode::tan: ExpBatchKernels::tan(row(inst.operand0), out, n); break;
+			case ExpOpcode::negate: ExpBatchKernels::unary<ExpBatchKernels::NegateOp>(row(inst.operand0), out, n); break;
+			case ExpOpcode::sqrt: ExpBatchKernels::unary<ExpBatchKernels::SqrtOp>(row(inst.operand0), out, n); break;
+
+			case ExpOpcode::add: ExpBatchKernels::binary<ExpBatchKernels::AddOp>(row(inst.operand0), row(inst.operand1), out, n); break;
+			case ExpOpcode::subtract: ExpBatchKernels::binary<ExpBatchKernels::SubtractOp>(row(inst.operand0), row(inst.operand1), out, n); break;
+			case ExpOpcode::multiply: ExpBatchKernels::binary<ExpBatchKernels::MultiplyOp>(row(inst.operand0), row(inst.operand1), out, n); break;
+			case ExpOpcode::divide: ExpBatchKernels::binary<ExpBatchKernels::DivideOp>(row(inst.operand0), row(inst.operand1), out, n); break;
+			case ExpOpcode::pow: ExpBatchKernels::pow(row(inst.operand0), row(inst.operand1), out, n); break;
+
+			default:
+				assert(false);
+				cout << "unknown opcode" << endl;
+				ExpBatchKernels::fill(0.0, out, n);
+			}
+		}
+	}
+};
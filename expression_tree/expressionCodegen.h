@@ -0,0 +1,748 @@
+#pragma once
+
+//
+// configurable code generation for ExpContext. toSourceCode(functionName) keeps the original
+// output; toSourceCode(functionName, options) and toSourceFiles go through ExpSourceWriter.
+//
+
+#if defined(_WIN32)
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+
+struct ExpCodegenOptions
+{
+	ExpCodegenOptions()
+	{
+		residualOutput = false;
+		reuseTemporaries = false;
+		hoistConstants = false;
+		sparseFunctors = false;
+		chunkSize = 0;
+		instantiationTypes.push_back("double");
+	}
+
+	// emit void f(const T* paramsA, const double* paramsB, T* residuals) plus a ceres functor.
+	// registered functions are called as void name(const T* params, T* results) on fixed-size
+	// stack arrays, the same shape as ExpNativeFunction, so an evaluation never allocates.
+	bool residualOutput;
+
+	// with residualOutput, write values into a bounded set of reused temporaries assigned by
+	// ExpPasses::allocateRegisters instead of one const T per step. keeps the stack frame small
+	// for Jet types. not used for chunked output.
+	bool reuseTemporaries;
+
+	// with residualOutput, read constants from a runtime table instead of baking them into the
+	// source. the function takes const double* constants after paramsB, filled from
+	// ExpContext::constantTable(), so the code only changes when ExpContext::structuralHash does.
+	bool hoistConstants;
+
+	//
+	// with residualOutput, also emit one functor per group of results that read the same paramsA
+	// blocks (see ExpPasses::computeResultDependencies) and <fn>_addResidualBlocks, which adds
+	// them to a ceres::Problem. each functor only takes the blocks it reads, so the jacobian is
+	// block sparse. paramBlockSizes splits paramsA into consecutive blocks, e.g. one per layer;
+	// when empty every entry is its own block.
+	//
+	bool sparseFunctors;
+	vector<int> paramBlockSizes;
+
+	//
+	// used by toSourceFiles. with chunkSize > 0 the steps are split into roughly chunkSize-step
+	// functions, each in its own .cpp with explicit instantiations for instantiationTypes (e.g.
+	// "ceres::Jet<double, 12>"). values that cross a chunk boundary travel in a generated state
+	// struct. prelude is placed at the top of the shared header, e.g. includes and definitions of
+	// registered functions. chunked output always uses the residualOutput form.
+	//
+	int chunkSize;
+	vector<string> instantiationTypes;
+	string prelude;
+};
+
+struct ExpSourceFile
+{
+	string name;
+	vector<string> lines;
+};
+
+struct ExpSourceWriter
+{
+	ExpSourceWriter(const ExpContext &_context, const ExpCodegenOptions &_options)
+		: context(_context), options(_options)
+	{
+		indent = "    ";
+		useRegisters = options.reuseTemporaries && options.chunkSize == 0;
+		if (useRegisters)
+			allocation = ExpPasses::allocateRegisters(context, true);
+
+		constantCount = 0;
+		if (options.hoistConstants)
+		{
+			constantIndex.assign(context.steps.size(), -1);
+			for (const ExpStepData &s : context.steps)
+			{
+				if (s.type == ExpStepType::constant)
+					constantIndex[s.stepIndex] = constantCount++;
+			}
+		}
+	}
+
+	// constants are printed with full precision so generated code matches the interpreter
+	static string formatConstant(double value)
+	{
+		char buffer[32];
+		snprintf(buffer, sizeof(buffer), "%.17g", value);
+		return buffer;
+	}
+
+	string valueName(int stepIndex) const
+	{
+		if (!useRegisters)
+			return "s" + to_string(stepIndex);
+		const ExpStepData &s = context.steps[stepIndex];
+		if (s.type == ExpStepType::functionCall)
+			return arrayName(context.functions.at(context.functionList[s.functionIndex]).resultCount, allocation.registers[stepIndex]);
+		return "r" + to_string(allocation.registers[stepIndex]);
+	}
+
+	static string arrayName(int resultCount, int index)
+	{
+		return "a" + to_string(resultCount) + "_" + to_string(index);
+	}
+
+	// declarations for every register and call result array, a few per line
+	void writeRegisterDeclarations(vector<string> &lines) const
+	{
+		const int perLine = 16;
+		for (int r = 0; r < allocation.registerCount; r += perLine)
+		{
+			string line = indent + "T ";
+			for (int i = r; i < min(r + perLine, allocation.registerCount); i++)
+				line += (i == r ? "" : ", ") + string("r") + to_string(i);
+			lines.push_back(line + ";");
+		}
+		for (const auto &pool : allocation.arrayCounts)
+		{
+			string line = indent + "T ";
+			for (int i = 0; i < pool.second; i++)
+				line += (i == 0 ? "" : ", ") + arrayName(pool.first, i) + "[" + to_string(max(pool.first, 1)) + "]";
+			lines.push_back(line + ";");
+		}
+	}
+
+	// right-hand side for every step type that produces a single value
+	string expression(const ExpStepData &s) const
+	{
+		if (s.type == ExpStepType::constant)
+			return options.hoistConstants ? "T(constants[" + to_string(constantIndex[s.stepIndex]) + "])" : "T(" + formatConstant(s.value) + ")";
+		if (s.type == ExpStepType::parameter)
+		{
+			if (s.parameterSlot != 0)
+				return "T(paramsB[" + to_string(s.parameterIndex) + "])";
+			return paramAExpressions.empty() ? "paramsA[" + to_string(s.parameterIndex) + "]" : paramAExpressions[s.parameterIndex];
+		}
+		if (s.type == ExpStepType::unaryOp)
+			return getOpName(s.op) + "(" + valueName(s.operand0Step) + ")";
+		if (s.type == ExpStepType::binaryOp)
+		{
+			if (s.op == ExpOpType::pow)
+				return "pow(" + valueName(s.operand0Step) + ", " + valueName(s.operand1Step) + ")";
+			return valueName(s.operand0Step) + getOpName(s.op) + valueName(s.operand1Step);
+		}
+		if (s.type == ExpStepType::functionOutput)
+			return valueName(s.functionStepIndex) + "[" + to_string(s.functionOutputIndex) + "]";
+		return "invalid";
+	}
+
+	void writeStep(const ExpStepData &s, vector<string> &lines) const
+	{
+		const string name = valueName(s.stepIndex);
+		if (s.type == ExpStepType::result)
+		{
+			const int residual = residualIndices.empty() ? s.resultIndex : residualIndices[s.resultIndex];
+			const string &comment = context.getStepName(s.stepIndex);
+			lines.push_back(indent + "residuals[" + to_string(residual) + "] = " + valueName(s.operand0Step) + ";" + (comment.empty() ? "" : " // " + comment));
+		}
+		else if (s.type == ExpStepType::functionCall)
+		{
+			const ExpContext::FunctionInfo &info = context.functions.at(context.functionList[s.functionIndex]);
+			const int paramCount = context.getCallParamCount(s);
+			const int *params = context.getCallParams(s);
+			string paramList;
+			for (int i = 0; i < paramCount; i++)
+				paramList += (i == 0 ? "" : ", ") + valueName(params[i]);
+
+			if (useRegisters)
+			{
+				lines.push_back(indent + "{");
+				lines.push_back(indent + indent + "const T params[" + to_string(max(paramCount, 1)) + "] = { " + paramList + " };");
+				lines.push_back(indent + indent + context.functionList[s.functionIndex] + "(params, " + name + ");");
+				lines.push_back(indent + "}");
+				return;
+			}
+			lines.push_back(indent + "const T " + name + "_params[" + to_string(max(paramCount, 1)) + "] = { " + paramList + " };");
+			lines.push_back(indent + "T " + name + "[" + to_string(max(info.resultCount, 1)) + "];");
+			lines.push_back(indent + context.functionList[s.functionIndex] + "(" + name + "_params, " + name + ");");
+		}
+		else if (s.type != ExpStepType::invalid)
+		{
+			// nothing reads it, and its register may already belong to another value
+			if (useRegisters && allocation.lastUse[s.stepIndex] == -1)
+				return;
+			const string &comment = context.getStepName(s.stepIndex);
+			lines.push_back(indent + (useRegisters ? "" : "const T ") + name + " = " + expression(s) + ";" + (comment.empty() ? "" : " // " + comment));
+		}
+	}
+
+	// parameter list of the generated function for value type T
+	string parameterList(const string &type) const
+	{
+		return "const " + type + "* const paramsA, const double* const paramsB, " +
+			(options.hoistConstants ? "const double* const constants, " : "") + type + "* residuals";
+	}
+
+	string argumentList() const
+	{
+		return options.hoistConstants ? "paramsA, paramsB, constants, residuals" : "paramsA, paramsB, residuals";
+	}
+
+	void writeCounts(const string &functionName, vector<string> &lines) const
+	{
+		lines.push_back("static const int " + functionName + "_paramACount = " + to_string(context._paramCounts[0]) + ";");
+		lines.push_back("static const int " + functionName + "_paramBCount = " + to_string(context._paramCounts[1]) + ";");
+		lines.push_back("static const int " + functionName + "_resultCount = " + to_string(context.resultCount) + ";");
+		if (options.hoistConstants)
+			lines.push_back("static const int " + functionName + "_constantCount = " + to_string(constantCount) + ";");
+		lines.push_back("");
+	}
+
+	vector<string> writeFunction(const string &functionName)
+	{
+		vector<string> lines;
+		writeCounts(functionName, lines);
+
+		lines.push_back("template <class T>");
+		lines.push_back("void " + functionName + "(" + parameterList("T") + ")");
+		lines.push_back("{");
+		if (useRegisters)
+			writeRegisterDeclarations(lines);
+		for (const ExpStepData &s : context.steps)
+			writeStep(s, lines);
+		lines.push_back("}");
+		lines.push_back("");
+		writeFunctor(functionName, lines);
+		if (options.sparseFunctors)
+			writeSparseFunctors(functionName, lines);
+		return lines;
+	}
+
+	string functorConstructor(const string &functor) const
+	{
+		if (options.hoistConstants)
+			return functor + "(const double *_paramsB, const double *_constants) : paramsB(_paramsB), constants(_constants) {}";
+		return "explicit " + functor + "(const double *_paramsB) : paramsB(_paramsB) {}";
+	}
+
+	//
+	// one functor per distinct set of parameter blocks. each evaluates only the steps its results
+	// reach, with paramsA entries read from the block pointers. ceres::AutoDiffCostFunction takes
+	// at most ten blocks, larger groups use ceres::DynamicAutoDiffCostFunction. results that
+	// read no paramsA entry are left out since they do not affect the solve.
+	//
+	void writeSparseFunctors(const string &functionName, vector<string> &lines)
+	{
+		const int paramCount = context._paramCounts[0];
+		vector<int> blockStart, blockSize;
+		vector<int> blockOfParam(paramCount);
+		for (int p = 0; p < paramCount; )
+		{
+			const int b = (int)blockStart.size();
+			const int size = b < (int)options.paramBlockSizes.size() ? options.paramBlockSizes[b] : 1;
+			blockStart.push_back(p);
+			blockSize.push_back(min(max(size, 1), paramCount - p));
+			for (int i = 0; i < blockSize.back(); i++)
+				blockOfParam[p + i] = b;
+			p += blockSize.back();
+		}
+
+		vector<int> resultStep(context.resultCount, -1);
+		for (const ExpStepData &s : context.steps)
+		{
+			if (s.type == ExpStepType::result)
+				resultStep[s.resultIndex] = s.stepIndex;
+		}
+
+		// block set -> result indices, in result order
+		const vector<vector<int>> dependencies = ExpPasses::computeResultDependencies(context);
+		map<vector<int>, vector<int>> groups;
+		vector<vector<int>> groupOrder;
+		for (int r = 0; r < context.resultCount; r++)
+		{
+			vector<int> blocks;
+			for (int p : dependencies[r])
+				blocks.push_back(blockOfParam[p]);
+			blocks.erase(unique(blocks.begin(), blocks.end()), blocks.end());
+			if (blocks.empty() || resultStep[r] == -1)
+				continue;
+			if (groups.count(blocks) == 0)
+				groupOrder.push_back(blocks);
+			groups[blocks].push_back(r);
+		}
+
+		vector<string> addLines;
+		for (int g = 0; g < (int)groupOrder.size(); g++)
+		{
+			const vector<int> &blocks = groupOrder[g];
+			const vector<int> &results = groups[blocks];
+			const string functor = functionName + "_Group" + to_string(g);
+			const bool dynamic = blocks.size() > 10;
+
+			// steps reached from the group's results
+			vector<bool> needed(context.steps.size(), false);
+			for (int r : results)
+				needed[resultStep[r]] = true;
+			for (int i = (int)context.steps.size() - 1; i >= 0; i--)
+			{
+				if (needed[i])
+				{
+					ExpPasses::forEachOperand(context, context.steps[i], [&](int operand) { needed[operand] = true; });
+				}
+			}
+
+			paramAExpressions.assign(paramCount, "T(0.0)");
+			for (int b : blocks)
+			{
+				for (int i = 0; i < blockSize[b]; i++)
+					paramAExpressions[blockStart[b] + i] = "b" + to_string(b) + "[" + to_string(i) + "]";
+			}
+			residualIndices.assign(context.resultCount, -1);
+			string resultList;
+			for (int i = 0; i < (int)results.size(); i++)
+			{
+				residualIndices[results[i]] = i;
+				resultList += (i == 0 ? "" : ", ") + to_string(results[i]);
+			}
+
+			string blockParams, blockSizes, blockPointers;
+			for (int b : blocks)
+			{
+				blockParams += "const T* const b" + to_string(b) + ", ";
+				blockSizes += ", " + to_string(blockSize[b]);
+				blockPointers += ", paramsA + " + to_string(blockStart[b]);
+			}
+
+			lines.push_back("");
+			lines.push_back("// results " + resultList);
+			lines.push_back("struct " + functor);
+			lines.push_back("{");
+			lines.push_back(indent + "static const int residualCount = " + to_string(results.size()) + ";");
+			lines.push_back("");
+			lines.push_back(indent + functorConstructor(functor));
+			lines.push_back("");
+			lines.push_back(indent + "template <class T>");
+			if (dynamic)
+			{
+				lines.push_back(indent + "bool operator()(T const* const* blocks, T* residuals) const");
+				lines.push_back(indent + "{");
+				for (int k = 0; k < (int)blocks.size(); k++)
+					lines.push_back(indent + indent + "const T* const b" + to_string(blocks[k]) + " = blocks[" + to_string(k) + "];");
+			}
+			else
+			{
+				lines.push_back(indent + "bool operator()(" + blockParams + "T* residuals) const");
+				lines.push_back(indent + "{");
+			}
+			// the body sits one level deeper than in the plain function
+			const string outerIndent = indent;
+			indent += outerIndent;
+			if (useRegisters)
+				writeRegisterDeclarations(lines);
+			for (const ExpStepData &s : context.steps)
+			{
+				if (needed[s.stepIndex])
+					writeStep(s, lines);
+			}
+			lines.push_back(indent + "return true;");
+			indent = outerIndent;
+			lines.push_back(indent + "}");
+			lines.push_back("");
+			lines.push_back(indent + "const double *paramsB;");
+			if (options.hoistConstants)
+				lines.push_back(indent + "const double *constants;");
+			lines.push_back("};");
+
+			const string create = "new " + functor + (options.hoistConstants ? "(paramsB, constants)" : "(paramsB)");
+			if (dynamic)
+			{
+				const string name = "cost" + to_string(g);
+				addLines.push_back(indent + "{");
+				addLines.push_back(indent + indent + "ceres::DynamicAutoDiffCostFunction<" + functor + "> *" + name + " = new ceres::DynamicAutoDiffCostFunction<" + functor + ">(" + create + ");");
+				string pointerList;
+				for (int b : blocks)
+				{
+					addLines.push_back(indent + indent + name + "->AddParameterBlock(" + to_string(blockSize[b]) + ");");
+					pointerList += (pointerList.empty() ? "" : ", ") + string("paramsA + ") + to_string(blockStart[b]);
+				}
+				addLines.push_back(indent + indent + name + "->SetNumResiduals(" + to_string(results.size()) + ");");
+				addLines.push_back(indent + indent + "const vector<double*> blocks = { " + pointerList + " };");
+				addLines.push_back(indent + indent + "problem.AddResidualBlock(" + name + ", loss, blocks);");
+				addLines.push_back(indent + "}");
+			}
+			else
+			{
+				addLines.push_back(indent + "problem.AddResidualBlock(new ceres::AutoDiffCostFunction<" + functor + ", " + to_string(results.size()) + blockSizes + ">(" + create + "), loss" + blockPointers + ");");
+			}
+		}
+		paramAExpressions.clear();
+		residualIndices.clear();
+
+		// paramsA is the solver's parameter storage, block b starts at the sum of the earlier block sizes
+		lines.push_back("");
+		lines.push_back("inline void " + functionName + "_addResidualBlocks(ceres::Problem &problem, double *paramsA, const double *paramsB, " +
+			(options.hoistConstants ? "const double *constants, " : "") + "ceres::LossFunction *loss = nullptr)");
+		lines.push_back("{");
+		for (const string &line : addLines)
+			lines.push_back(line);
+		lines.push_back("}");
+	}
+
+	// usable directly with ceres::AutoDiffCostFunction<functor, resultCount, paramACount>.
+	// paramsB and constants are not owned and must outlive the functor.
+	void writeFunctor(const string &functionName, vector<string> &lines) const
+	{
+		const string functor = functionName + "_Functor";
+		lines.push_back("struct " + functor);
+		lines.push_back("{");
+		lines.push_back(indent + functorConstructor(functor));
+		lines.push_back("");
+		lines.push_back(indent + "template <class T>");
+		lines.push_back(indent + "bool operator()(const T* const paramsA, T* residuals) const");
+		lines.push_back(indent + "{");
+		lines.push_back(indent + indent + functionName + "(" + argumentList() + ");");
+		lines.push_back(indent + indent + "return true;");
+		lines.push_back(indent + "}");
+		lines.push_back("");
+		lines.push_back(indent + "const double *paramsB;");
+		if (options.hoistConstants)
+			lines.push_back(indent + "const double *constants;");
+		lines.push_back("};");
+	}
+
+	// constants and parameters are cheap to re-read, so chunks recreate them instead of passing them
+	bool crossesChunks(int stepIndex, int chunkEnd, const vector<int> &lastUse) const
+	{
+		const ExpStepType type = context.steps[stepIndex].type;
+		return lastUse[stepIndex] >= chunkEnd && type != ExpStepType::constant && type != ExpStepType::parameter;
+	}
+
+	//
+	// chunk boundaries as step indices, starting with 0 and ending with steps.size(). each cut is
+	// placed within 25% of chunkSize where the fewest values cross it, and never between a function
+	// call and its outputs.
+	//
+	vector<int> chooseChunkBoundaries(const vector<int> &lastUse) const
+	{
+		const int stepCount = (int)context.steps.size();
+
+		// crossing[c] = number of values defined before step c and read at or after it
+		vector<int> crossing(stepCount + 2, 0);
+		for (int j = 0; j < stepCount; j++)
+		{
+			if (crossesChunks(j, j + 1, lastUse))
+			{
+				crossing[j + 1]++;
+				crossing[lastUse[j] + 1]--;
+			}
+		}
+		for (int c = 1; c <= stepCount; c++)
+			crossing[c] += crossing[c - 1];
+
+		vector<int> boundaries(1, 0);
+		const int target = max(options.chunkSize, 1);
+		int start = 0;
+		while (stepCount - start > target + target / 4)
+		{
+			const int low = start + max(target * 3 / 4, 1);
+			const int high = min(start + target + target / 4, stepCount - 1);
+			int best = -1;
+			for (int c = low; c <= high; c++)
+			{
+				if (context.steps[c].type == ExpStepType::functionOutput)
+					continue;
+				if (best == -1 || crossing[c] < crossing[best])
+					best = c;
+			}
+			if (best == -1)
+			{
+				best = high;
+				while (best < stepCount && context.steps[best].type == ExpStepType::functionOutput)
+					best++;
+				if (best == stepCount)
+					break;
+			}
+			boundaries.push_back(best);
+			start = best;
+		}
+		boundaries.push_back(stepCount);
+		return boundaries;
+	}
+
+	string chunkSignature(const string &functionName, int chunkIndex, const string &type) const
+	{
+		return "void " + functionName + "_chunk" + to_string(chunkIndex) + "(" + parameterList(type) + ", " + functionName + "_State<" + type + "> &state)";
+	}
+
+	vector<ExpSourceFile> writeChunkedFiles(const string &functionName) const
+	{
+		const vector<int> lastUse = ExpPasses::computeLastUse(context);
+		const vector<int> boundaries = chooseChunkBoundaries(lastUse);
+		const int chunkCount = (int)boundaries.size() - 1;
+		const string stateType = functionName + "_State";
+
+		ExpSourceFile header;
+		header.name = functionName + ".h";
+		vector<string> &h = header.lines;
+		h.push_back("#pragma once");
+		h.push_back("");
+		if (!options.prelude.empty())
+		{
+			h.push_back(options.prelude);
+			h.push_back("");
+		}
+		writeCounts(functionName, h);
+
+		// values that live across a chunk boundary
+		h.push_back("template <class T>");
+		h.push_back("struct " + stateType);
+		h.push_back("{");
+		int chunkIndex = 0;
+		for (int j = 0; j < (int)context.steps.size(); j++)
+		{
+			while (j >= boundaries[chunkIndex + 1])
+				chunkIndex++;
+			if (crossesChunks(j, boundaries[chunkIndex + 1], lastUse))
+				h.push_back(indent + "T " + valueName(j) + ";");
+		}
+		h.push_back("};");
+		h.push_back("");
+
+		for (int c = 0; c < chunkCount; c++)
+		{
+			h.push_back("template <class T>");
+			h.push_back(chunkSignature(functionName, c, "T") + ";");
+		}
+		h.push_back("");
+
+		h.push_back("template <class T>");
+		h.push_back("void " + functionName + "(" + parameterList("T") + ")");
+		h.push_back("{");
+		h.push_back(indent + stateType + "<T> state;");
+		for (int c = 0; c < chunkCount; c++)
+			h.push_back(indent + functionName + "_chunk" + to_string(c) + "(" + argumentList() + ", state);");
+		h.push_back("}");
+		h.push_back("");
+		writeFunctor(functionName, h);
+
+		vector<ExpSourceFile> files(1, header);
+		for (int c = 0; c < chunkCount; c++)
+		{
+			const int begin = boundaries[c];
+			const int end = boundaries[c + 1];
+
+			ExpSourceFile chunk;
+			chunk.name = functionName + "_chunk" + to_string(c) + ".cpp";
+			vector<string> &lines = chunk.lines;
+			lines.push_back("#include \"" + header.name + "\"");
+			lines.push_back("");
+			lines.push_back("template <class T>");
+			lines.push_back(chunkSignature(functionName, c, "T"));
+			lines.push_back("{");
+
+			// inputs from earlier chunks, in step order so the output is stable
+			vector<bool> imported(begin, false);
+			for (int i = begin; i < end; i++)
+			{
+				ExpPasses::forEachOperand(context, context.steps[i], [&](int operand) { if (operand < begin) imported[operand] = true; });
+			}
+			for (int j = 0; j < begin; j++)
+			{
+				if (imported[j])
+					lines.push_back(indent + "const T " + valueName(j) + " = " + (crossesChunks(j, begin, lastUse) ? "state." + valueName(j) : expression(context.steps[j])) + ";");
+			}
+
+			for (int i = begin; i < end; i++)
+				writeStep(context.steps[i], lines);
+
+			for (int j = begin; j < end; j++)
+			{
+				if (crossesChunks(j, end, lastUse))
+					lines.push_back(indent + "state." + valueName(j) + " = " + valueName(j) + ";");
+			}
+			lines.push_back("}");
+			lines.push_back("");
+
+			for (const string &type : options.instantiationTypes)
+				lines.push_back("template " + chunkSignature(functionName, c, type) + ";");
+			files.push_back(chunk);
+		}
+		return files;
+	}
+
+	//
+	// writes each file into directory, skipping files whose contents are unchanged so their
+	// timestamps stay put and only edited chunks are rebuilt. returns the number of files written.
+	//
+	static int writeFiles(const vector<ExpSourceFile> &files, const string &directory)
+	{
+#if defined(_WIN32)
+		_mkdir(directory.c_str());
+#else
+		mkdir(directory.c_str(), 0755);
+#endif
+		int written = 0;
+		for (const ExpSourceFile &file : files)
+		{
+			string contents;
+			for (const string &line : file.lines)
+				contents += line + "\n";
+
+			const string path = directory + "/" + file.name;
+			ifstream existing(path, ios::binary);
+			if (existing)
+			{
+				string previous((istreambuf_iterator<char>(existing)), istreambuf_iterator<char>());
+				if (previous == contents)
+					continue;
+			}
+			existing.close();
+
+			ofstream out(path, ios::binary);
+			out << contents;
+			written++;
+		}
+		return written;
+	}
+
+	const ExpContext &context;
+	const ExpCodegenOptions &options;
+	string indent;
+
+	bool useRegisters;
+	ExpRegisterAllocation allocation;
+
+	// overrides used while writing the sparse functors: the expression for each paramsA entry
+	// and the residual slot for each result index
+	vector<string> paramAExpressions;
+	vector<int> residualIndices;
+
+	// index into the constant table for each constant step, only filled with hoistConstants
+	vector<int> constantIndex;
+	int constantCount;
+};
+
+inline vector<string> ExpContext::toSourceCode(const string &functionName, const ExpCodegenOptions &options) const
+{
+	if (!options.residualOutput)
+		return toSourceCode(functionName);
+	return ExpSourceWriter(*this, options).writeFunction(functionName);
+}
+
+inline vector<ExpSourceFile> ExpContext::toSourceFiles(const string &functionName, const ExpCodegenOptions &options) const
+{
+	if (options.chunkSize > 0)
+		return ExpSourceWriter(*this, options).writeChunkedFiles(functionName);
+
+	ExpCodegenOptions residualOptions = options;
+	residualOptions.residualOutput = true;
+	ExpSourceFile file;
+	file.name = functionName + ".h";
+	file.lines.push_back("#pragma once");
+	file.lines.push_back("");
+	if (!options.prelude.empty())
+	{
+		file.lines.push_back(options.prelude);
+		file.lines.push_back("");
+	}
+	for (const string &line : ExpSourceWriter(*this, residualOptions).writeFunction(functionName))
+		file.lines.push_back(line);
+	return vector<ExpSourceFile>(1, file);
+}
+
+inline vector<double> ExpContext::constantTable() const
+{
+	vector<double> result;
+	for (const ExpStepData &s : steps)
+	{
+		if (s.type == ExpStepType::constant)
+			result.push_back(s.value);
+	}
+	return result;
+}
+
+inline unsigned long long ExpContext::structuralHash() const
+{
+	// 64-bit FNV-1a over the fields that affect generated code
+	unsigned long long h = 14695981039346656037ULL;
+	auto mix = [&](long long value)
+	{
+		for (int i = 0; i < 8; i++)
+		{
+			h ^= (unsigned char)(value >> (i * 8));
+			h *= 1099511628211ULL;
+		}
+	};
+	auto mixString = [&](const string &value)
+	{
+		mix((long long)value.size());
+		for (unsigned char c : value)
+		{
+			h ^= c;
+			h *= 1099511628211ULL;
+		}
+	};
+
+	mix(_paramCounts[0]);
+	mix(_paramCounts[1]);
+	mix(resultCount);
+	for (const string &name : functionList)
+	{
+		mixString(name);
+		mix(functions.at(name).paramCount);
+		mix(functions.at(name).resultCount);
+	}
+
+	for (const ExpStepData &s : steps)
+	{
+		mix((long long)s.type);
+		if (s.type == ExpStepType::parameter)
+		{
+			mix(s.parameterSlot);
+			mix(s.parameterIndex);
+		}
+		else if (s.type == ExpStepType::result)
+		{
+			mix(s.operand0Step);
+			mix(s.resultIndex);
+		}
+		else if (s.type == ExpStepType::unaryOp || s.type == ExpStepType::binaryOp)
+		{
+			mix((long long)s.op);
+			mix(s.operand0Step);
+			mix(s.type == ExpStepType::binaryOp ? s.operand1Step : -1);
+		}
+		else if (s.type == ExpStepType::functionCall)
+		{
+			mix(s.functionIndex);
+			mix(getCallParamCount(s));
+			for (int i = 0; i < getCallParamCount(s); i++)
+				mix(getCallParams(s)[i]);
+		}
+		else if (s.type == ExpStepType::functionOutput)
+		{
+			mix(s.functionStepIndex);
+			mix(s.functionOutputIndex);
+		}
+	}
+	return h;
+}
@@ -2,6 +2,49 @@
 
 #include "expressionStep.h"
 
+struct ExpPassStats;
+struct ExpCodegenOptions;
+struct ExpSourceFile;
+
+// native implementation of a registered function. params holds paramCount values and
+// results receives resultCount values.
+typedef function<void(const double *params, double *results)> ExpNativeFunction;
+
+// batched form, all arrays are SoA: params[paramIndex * laneCount + lane], results[resultIndex * laneCount + lane]
+typedef function<void(int laneCount, const double *params, double *results)> ExpNativeBatchFunction;
+
+// derivatives of a registered function. jacobian receives resultCount x paramCount values, row-major.
+typedef function<void(const double *params, double *jacobian)> ExpNativeDerivative;
+
+// structural identity of a step, used to hash-cons steps in ExpContext::addStep
+struct ExpStepKey
+{
+	ExpStepType type;
+	ExpOpType op;
+	int operand0;
+	int operand1;
+	unsigned long long valueBits;
+
+	bool operator == (const ExpStepKey &other) const
+	{
+		return type == other.type && op == other.op && operand0 == other.operand0 &&
+			operand1 == other.operand1 && valueBits == other.valueBits;
+	}
+};
+
+struct ExpStepKeyHash
+{
+	size_t operator()(const ExpStepKey &key) const
+	{
+		size_t h = hash<unsigned long long>()(key.valueBits);
+		h = h * 31 + (size_t)key.type;
+		h = h * 31 + (size_t)key.op;
+		h = h * 31 + (size_t)key.operand0;
+		h = h * 31 + (size_t)key.operand1;
+		return h;
+	}
+};
+
 // the context in which a set of expressions is executed
 struct ExpContext
 {
@@ -22,11 +65,20 @@ struct ExpContext
 		int globalIndex;
 		int paramCount;
 		int resultCount;
+
+		// optional, used by the interpreters. calls without a binding evaluate to 0.
+		ExpNativeFunction native;
+		ExpNativeBatchFunction nativeBatch;
+
+		// optional, used by ExpGradientEvaluator. without it the derivatives are taken by central
+		// differences through the native binding.
+		ExpNativeDerivative derivative;
 	};
 
 	ExpContext()
 	{
 		resultCount = 0;
+		hashConsing = false;
     _paramCounts.resize(2, 0);
 	}
 
@@ -39,23 +91,49 @@ struct ExpContext
 
 	ExpStep registerParam(int paramSlot, string paramName, double unusedDefaultValue = numeric_limits<double>::max())
 	{
-		ExpStepData step = ExpStepData::makeParameter(paramName, unusedDefaultValue, paramSlot, _paramCounts[paramSlot]);
+		ExpStepData step = ExpStepData::makeParameter(unusedDefaultValue, paramSlot, _paramCounts[paramSlot]);
     _paramCounts[paramSlot]++;
 		addStep(step);
+		stepNames[step.stepIndex] = paramName;
+		_paramSteps[paramSlot][paramName] = step.stepIndex;
 		return ExpStep(this, step.stepIndex);
 	}
 
+	// step index of the parameter registered under paramName in paramSlot, -1 if there is none
+	int findParam(int paramSlot, const string &paramName) const
+	{
+		auto it = _paramSteps[paramSlot].find(paramName);
+		return it == _paramSteps[paramSlot].end() ? -1 : it->second;
+	}
+
 	void registerResult(const ExpStep &step, int resultIndex, const string &resultName)
 	{
-		ExpStepData stepData = ExpStepData::makeResult(resultName, step.stepIndex, resultIndex);
+		ExpStepData stepData = ExpStepData::makeResult(step.stepIndex, resultIndex);
 		addStep(stepData);
+		stepNames[stepData.stepIndex] = resultName;
 		resultCount = max(resultCount, resultIndex + 1);
 	}
 
 	ExpStep addStep(ExpStepData &step)
 	{
+		if (hashConsing)
+		{
+			int existingIndex = findStep(step);
+			if (existingIndex != -1)
+			{
+				// a shared call does not need the parameter list that was just appended
+				if (step.type == ExpStepType::functionCall)
+					callParams.resize(step.callParamsIndex);
+				step.stepIndex = existingIndex;
+				return ExpStep(this, step.stepIndex);
+			}
+		}
+
 		step.stepIndex = (int)steps.size();
 		steps.push_back(step);
+
+		if (hashConsing)
+			cacheStep(step);
 		return ExpStep(this, step.stepIndex);
 	}
 
@@ -66,6 +144,36 @@ struct ExpContext
 		functions[functionName] = FunctionInfo(functionIndex, parameterCount, resultCount);
 	}
 
+	void bindFunc(const string &functionName, const ExpNativeFunction &native)
+	{
+		if (functions.count(functionName) == 0)
+		{
+			cout << "Function not found: " << functionName << endl;
+			return;
+		}
+		functions[functionName].native = native;
+	}
+
+	void bindBatchFunc(const string &functionName, const ExpNativeBatchFunction &nativeBatch)
+	{
+		if (functions.count(functionName) == 0)
+		{
+			cout << "Function not found: " << functionName << endl;
+			return;
+		}
+		functions[functionName].nativeBatch = nativeBatch;
+	}
+
+	void bindFuncDerivative(const string &functionName, const ExpNativeDerivative &derivative)
+	{
+		if (functions.count(functionName) == 0)
+		{
+			cout << "Function not found: " << functionName << endl;
+			return;
+		}
+		functions[functionName].derivative = derivative;
+	}
+
 	vector<ExpStep> callFunc(const string &functionName, const ExpStep &p0)
 	{
 		vector<ExpStep> params;
@@ -125,7 +233,11 @@ struct ExpContext
 			cout << "Function not found: " << functionName << endl;
 		}
 		const FunctionInfo &info = functions[functionName];
-		ExpStepData callStepData = ExpStepData::makeFunctionCall(info.globalIndex, fixedParams);
+		const int callParamsIndex = (int)callParams.size();
+		callParams.push_back((int)fixedParams.size());
+		for (const ExpStep &p : fixedParams)
+			callParams.push_back(p.stepIndex);
+		ExpStepData callStepData = ExpStepData::makeFunctionCall(info.globalIndex, callParamsIndex);
 		addStep(callStepData);
 
 		vector<ExpStep> result;
@@ -137,14 +249,57 @@ struct ExpContext
 		return result;
 	}
 
-	double eval() const
+	// evaluates the steps once with the default parameter values. function calls go through
+	// their native bindings. use ExpProgram for repeated evaluation, see expressionProgram.h
+	double eval() const;
+
+	// runs the default ExpPassManager pipeline over steps, see expressionPasses.h
+	vector<ExpPassStats> optimize();
+
+	// parameter step indices of a functionCall step
+	int getCallParamCount(const ExpStepData &step) const
+	{
+		return callParams[step.callParamsIndex];
+	}
+
+	const int* getCallParams(const ExpStepData &step) const
 	{
-		vector<double> values;
-		for (int i = 0; i < (int)steps.size(); i++)
+		return callParams.data() + step.callParamsIndex + 1;
+	}
+
+	int* getCallParams(const ExpStepData &step)
+	{
+		return callParams.data() + step.callParamsIndex + 1;
+	}
+
+	// empty for steps without a name
+	const string& getStepName(int stepIndex) const
+	{
+		static const string empty;
+		auto it = stepNames.find(stepIndex);
+		return it == stepNames.end() ? empty : it->second;
+	}
+
+	// call after steps have been rewritten in place so hash-consing and findParam see the new indices
+	void rebuildStepCache()
+	{
+		_paramSteps[0].clear();
+		_paramSteps[1].clear();
+		for (const ExpStepData &s : steps)
 		{
-			values.push_back(steps[i].eval(values));
+			if (s.type == ExpStepType::parameter)
+				_paramSteps[s.parameterSlot][getStepName(s.stepIndex)] = s.stepIndex;
+		}
+
+		_stepCache.clear();
+		_functionCallCache.clear();
+		if (!hashConsing)
+			return;
+		for (const ExpStepData &s : steps)
+		{
+			if (findStep(s) == -1)
+				cacheStep(s);
 		}
-		return values.back();
 	}
 
 	vector<string> toSourceCode(const string &functionName) const
@@ -172,7 +327,8 @@ struct ExpContext
 			}
 			else
 			{
-				result.push_back(indent + s.toSourceCode() + ";");
+				const string &name = getStepName(s.stepIndex);
+				result.push_back(indent + s.toSourceCode() + ";" + (name.empty() ? "" : " // " + name));
 			}
 		}
 		result.push_back(indent);
@@ -181,11 +337,111 @@ struct ExpContext
 		return result;
 	}
 
+	// code generation variants, see expressionCodegen.h
+	vector<string> toSourceCode(const string &functionName, const ExpCodegenOptions &options) const;
+
+	// the residual form as one header, or a header plus one .cpp per chunk when options.chunkSize > 0
+	vector<ExpSourceFile> toSourceFiles(const string &functionName, const ExpCodegenOptions &options) const;
+
+	// constant step values in step order, the runtime table for code generated with hoistConstants
+	vector<double> constantTable() const;
+
+	// hash of the graph structure that ignores constant values and step names. two contexts with
+	// the same fingerprint produce the same code with hoistConstants, so a compiled function can be
+	// reused with the new constantTable().
+	unsigned long long structuralHash() const;
+
+	// when enabled, addStep returns the index of an existing step that is structurally identical
+	// (same type, op, operands and constant value) instead of appending a duplicate.
+	// parameters and results are never shared.
+	bool hashConsing;
+
 	map<string, FunctionInfo> functions;
 	vector<string> functionList;
 	vector<ExpStepData> steps;
+
+	// side tables for the variable-size parts of steps. names of parameters and results are
+	// keyed by step index. each call's parameter list is stored as a count followed by the
+	// parameter step indices, starting at ExpStepData::callParamsIndex.
+	unordered_map<int, string> stepNames;
+	vector<int> callParams;
+
   vector<int> _paramCounts;
 	int resultCount;
+
+private:
+	static bool makeKey(const ExpStepData &step, ExpStepKey &key)
+	{
+		key.type = step.type;
+		key.op = ExpOpType::invalid;
+		key.operand0 = -1;
+		key.operand1 = -1;
+		key.valueBits = 0;
+		if (step.type == ExpStepType::constant)
+		{
+			memcpy(&key.valueBits, &step.value, sizeof(double));
+			return true;
+		}
+		if (step.type == ExpStepType::unaryOp || step.type == ExpStepType::binaryOp)
+		{
+			key.op = step.op;
+			key.operand0 = step.operand0Step;
+			key.operand1 = step.operand1Step;
+			return true;
+		}
+		if (step.type == ExpStepType::functionOutput)
+		{
+			key.operand0 = step.functionStepIndex;
+			key.operand1 = step.functionOutputIndex;
+			return true;
+		}
+		return false;
+	}
+
+	pair<int, vector<int>> makeCallKey(const ExpStepData &step) const
+	{
+		const int *params = getCallParams(step);
+		return make_pair(step.functionIndex, vector<int>(params, params + getCallParamCount(step)));
+	}
+
+	int findStep(const ExpStepData &step) const
+	{
+		if (step.type == ExpStepType::functionCall)
+		{
+			auto it = _functionCallCache.find(makeCallKey(step));
+			return it == _functionCallCache.end() ? -1 : it->second;
+		}
+
+		ExpStepKey key;
+		if (!makeKey(step, key))
+			return -1;
+		auto it = _stepCache.find(key);
+		return it == _stepCache.end() ? -1 : it->second;
+	}
+
+	void cacheStep(const ExpStepData &step)
+	{
+		if (step.type == ExpStepType::functionCall)
+		{
+			_functionCallCache[makeCallKey(step)] = step.stepIndex;
+			return;
+		}
+
+		ExpStepKey key;
+		if (makeKey(step, key))
+			_stepCache[key] = step.stepIndex;
+	}
+
+	unordered_map<ExpStepKey, int, ExpStepKeyHash> _stepCache;
+	map<pair<int, vector<int>>, int> _functionCallCache;
+	unordered_map<string, int> _paramSteps[2];
 };
 
-#include "expressionStep.inl"
\ No newline at end of file
+#include "expressionStep.inl"
+#include "expressionPasses.h"
+#include "expressionProgram.h"
+#include "expressionBatch.h"
+#include "expressionGradient.h"
+#include "expressionCodegen.h"
+#include "expressionJit.h"
+#include "expressionSerialize.h"
\ No newline at end of file
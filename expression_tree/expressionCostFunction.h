@@ -0,0 +1,39 @@
+#pragma once
+
+//
+// analytic ceres cost function for an ExpContext. residuals are the context's results,
+// jacobians come from the adjoint sweep in ExpGradientEvaluator, so no code generation is needed.
+//
+
+class ExpCostFunction : public ceres::CostFunction
+{
+public:
+	//
+	// program is not owned and must outlive the cost function. the program can be shared by many
+	// residual blocks, but a cost function cannot: Evaluate writes the evaluator's buffers, so
+	// adding one instance to several residual blocks races when ceres runs with num_threads > 1.
+	// use Create once per residual block.
+	//
+	ExpCostFunction(const ExpProgram &program, const vector<double> &_paramsB)
+		: evaluator(program), paramsB(_paramsB)
+	{
+		set_num_residuals(program.resultCount);
+		mutable_parameter_block_sizes()->push_back((int)program.defaultParamsA.size());
+	}
+
+	bool Evaluate(double const* const* parameters, double* residuals, double** jacobians) const
+	{
+		double *jacobian = jacobians == nullptr ? nullptr : jacobians[0];
+		evaluator.jacobian(parameters[0], paramsB.data(), residuals, jacobian);
+		return true;
+	}
+
+	static ceres::CostFunction* Create(const ExpProgram &program, const vector<double> &paramsB)
+	{
+		return new ExpCostFunction(program, paramsB);
+	}
+
+private:
+	mutable ExpGradientEvaluator evaluator;
+	vector<double> paramsB;
+};
@@ -0,0 +1,291 @@
+#pragma once
+
+//
+// reverse-mode differentiation over the compiled tape. a forward pass fills the values,
+// then a single backward sweep per result accumulates adjoints into every paramsA entry.
+// adjoints flow through function calls using the call's jacobian, see callJacobian.
+// a sweep only visits the steps its result depends on (its cone, computed once per result
+// and cached), so jacobian() costs the sum of the cone sizes rather than results x steps.
+// the program must not be recompiled once gradients have been taken.
+//
+
+struct ExpGradientEvaluator
+{
+	ExpGradientEvaluator()
+	{
+		program = nullptr;
+	}
+
+	explicit ExpGradientEvaluator(const ExpProgram &_program)
+	{
+		program = &_program;
+	}
+
+	// forward pass only, fills values and writes resultCount values into results
+	void evalResults(const double *paramsA, const double *paramsB, double *results)
+	{
+		forward(paramsA, paramsB);
+		for (int r = 0; r < program->resultCount; r++)
+		{
+			const int step = program->resultSteps[r];
+			results[r] = step == -1 ? 0.0 : values[step];
+		}
+	}
+
+	// gradient of one result with respect to paramsA. gradA must hold paramACount values.
+	void gradient(const double *paramsA, const double *paramsB, int resultIndex, double *gradA)
+	{
+		forward(paramsA, paramsB);
+		backward(resultIndex, gradA);
+	}
+
+	// results and the row-major resultCount x paramACount jacobian, as ceres expects it.
+	// jacobian may be nullptr when only the residuals are needed.
+	void jacobian(const double *paramsA, const double *paramsB, double *results, double *jacobian)
+	{
+		evalResults(paramsA, paramsB, results);
+		if (jacobian == nullptr)
+			return;
+
+		const int paramCount = (int)program->defaultParamsA.size();
+		for (int r = 0; r < program->resultCount; r++)
+		{
+			backward(r, jacobian + (size_t)r * paramCount);
+		}
+	}
+
+	const ExpProgram *program;
+
+	// values from the last forward pass
+	vector<double> values;
+
+	// d(result) / d(step) during a backward sweep. every entry is zero again once the sweep ends
+	vector<double> adjoints;
+
+	// d(result) / d(output) for every slot of the function result area, zero between sweeps
+	vector<double> outputAdjoints;
+
+	// for each result the steps it reads, directly or not, highest index first. built on demand
+	vector<vector<int>> cones;
+
+	// scratch for function call derivatives
+	vector<double> callParams;
+	vector<double> callJacobianValues;
+	vector<double> callResultsPlus;
+	vector<double> callResultsMinus;
+
+private:
+	void forward(const double *paramsA, const double *paramsB)
+	{
+		values.resize(program->valueCount());
+		program->evalValues(paramsA, paramsB, values.data());
+	}
+
+	// assumes forward() has already been run with the same parameters
+	void backward(int resultIndex, double *gradA)
+	{
+		const int paramCount = (int)program->defaultParamsA.size();
+		for (int p = 0; p < paramCount; p++)
+			gradA[p] = 0.0;
+
+		const int resultStep = program->resultSteps[resultIndex];
+		if (resultStep == -1)
+			return;
+
+		if (adjoints.size() != program->code.size())
+		{
+			adjoints.assign(program->code.size(), 0.0);
+			outputAdjoints.assign(program->functionResultCount, 0.0);
+		}
+		adjoints[resultStep] = 1.0;
+
+		const vector<int> &cone = getCone(resultIndex);
+		const ExpInstruction *code = program->code.data();
+		const double *v = values.data();
+		double *adj = adjoints.data();
+		for (int i : cone)
+		{
+			const ExpInstruction &inst = code[i];
+
+			// a call's own value is unused, its adjoints arrive through its outputs
+			if (inst.opcode == ExpOpcode::functionCall)
+			{
+				backwardCall(program->callSites[inst.operand0]);
+				continue;
+			}
+
+			const double a = adj[i];
+			if (a == 0.0)
+				continue;
+
+			const int o0 = inst.operand0;
+			const int o1 = inst.operand1;
+			switch (inst.opcode)
+			{
+			case ExpOpcode::constant: break;
+			case ExpOpcode::paramA: gradA[o0] += a; break;
+			case ExpOpcode::paramB: break;
+			case ExpOpcode::result: adj[o0] += a; break;
+
+			case ExpOpcode::functionCall: break;
+			case ExpOpcode::functionOutput: outputAdjoints[o0] += a; break;
+
+			case ExpOpcode::sin: adj[o0] += a * cos(v[o0]); break;
+			case ExpOpcode::cos: adj[o0] -= a * sin(v[o0]); break;
+			case ExpOpcode::tan: adj[o0] += a * (1.0 + v[i] * v[i]); break;
+			case ExpOpcode::negate: adj[o0] -= a; break;
+			case ExpOpcode::sqrt: adj[o0] += a * 0.5 / v[i]; break;
+
+			case ExpOpcode::add: adj[o0] += a; adj[o1] += a; break;
+			case ExpOpcode::subtract: adj[o0] += a; adj[o1] -= a; break;
+			case ExpOpcode::multiply: adj[o0] += a * v[o1]; adj[o1] += a * v[o0]; break;
+			case ExpOpcode::divide: adj[o0] += a / v[o1]; adj[o1] -= a * v[i] / v[o1]; break;
+			case ExpOpcode::pow:
+				adj[o0] += a * v[o1] * pow(v[o0], v[o1] - 1.0);
+				if (v[o0] > 0.0)
+					adj[o1] += a * v[i] * log(v[o0]);
+				break;
+
+			default:
+				assert(false);
+				cout << "unknown opcode" << endl;
+			}
+		}
+
+		// only the cone was written, so only the cone needs clearing for the next sweep
+		for (int i : cone)
+		{
+			adj[i] = 0.0;
+			if (code[i].opcode == ExpOpcode::functionOutput)
+				outputAdjoints[code[i].operand0] = 0.0;
+		}
+	}
+
+	const vector<int>& getCone(int resultIndex)
+	{
+		if (cones.size() != (size_t)program->resultCount)
+			cones.assign(program->resultCount, vector<int>());
+		vector<int> &cone = cones[resultIndex];
+		if (!cone.empty())
+			return cone;
+
+		// functionOutput instructions only know their slot in the result area, map it back to the call
+		const vector<ExpInstruction> &code = program->code;
+		vector<int> callOfSlot(program->functionResultCount, -1);
+		for (int i = 0; i < (int)code.size(); i++)
+		{
+			if (code[i].opcode != ExpOpcode::functionCall)
+				continue;
+			const ExpCallSite &site = program->callSites[code[i].operand0];
+			for (int r = 0; r < site.resultCount; r++)
+				callOfSlot[site.resultOffset + r] = i;
+		}
+
+		vector<bool> reached(code.size(), false);
+		vector<int> stack(1, program->resultSteps[resultIndex]);
+		reached[stack[0]] = true;
+		auto visit = [&](int step)
+		{
+			if (!reached[step])
+			{
+				reached[step] = true;
+				stack.push_back(step);
+			}
+		};
+		while (!stack.empty())
+		{
+			const int i = stack.back();
+			stack.pop_back();
+			const ExpInstruction &inst = code[i];
+			switch (inst.opcode)
+			{
+			case ExpOpcode::constant:
+			case ExpOpcode::paramA:
+			case ExpOpcode::paramB:
+				break;
+			case ExpOpcode::functionCall:
+			{
+				const ExpCallSite &site = program->callSites[inst.operand0];
+				for (int p = 0; p < site.paramCount; p++)
+					visit(program->callParams[site.paramOffset + p]);
+				break;
+			}
+			case ExpOpcode::functionOutput: visit(callOfSlot[inst.operand0]); break;
+			case ExpOpcode::result:
+			case ExpOpcode::sin:
+			case ExpOpcode::cos:
+			case ExpOpcode::tan:
+			case ExpOpcode::negate:
+			case ExpOpcode::sqrt:
+				visit(inst.operand0);
+				break;
+			default:
+				visit(inst.operand0);
+				visit(inst.operand1);
+			}
+		}
+
+		for (int i = (int)code.size() - 1; i >= 0; i--)
+		{
+			if (reached[i])
+				cone.push_back(i);
+		}
+		return cone;
+	}
+
+	// pushes the output adjoints of a call back to its parameters
+	void backwardCall(const ExpCallSite &site)
+	{
+		const double *outputAdj = outputAdjoints.data() + site.resultOffset;
+		bool reached = false;
+		for (int r = 0; r < site.resultCount; r++)
+			reached = reached || outputAdj[r] != 0.0;
+		if (!reached)
+			return;
+
+		const int *paramSteps = program->callParams.data() + site.paramOffset;
+		callParams.resize(site.paramCount);
+		for (int p = 0; p < site.paramCount; p++)
+			callParams[p] = values[paramSteps[p]];
+
+		callJacobian(site);
+		for (int p = 0; p < site.paramCount; p++)
+		{
+			double sum = 0.0;
+			for (int r = 0; r < site.resultCount; r++)
+				sum += outputAdj[r] * callJacobianValues[r * site.paramCount + p];
+			adjoints[paramSteps[p]] += sum;
+		}
+	}
+
+	//
+	// fills callJacobianValues with d(output) / d(parameter) at callParams, row-major. uses the
+	// derivative binding when there is one, otherwise central differences through the native
+	// binding with a step scaled to each parameter.
+	//
+	void callJacobian(const ExpCallSite &site)
+	{
+		callJacobianValues.assign(site.resultCount * site.paramCount, 0.0);
+		const ExpNativeDerivative &derivative = program->nativeDerivatives[site.functionIndex];
+		if (derivative)
+		{
+			derivative(callParams.data(), callJacobianValues.data());
+			return;
+		}
+
+		callResultsPlus.resize(site.resultCount);
+		callResultsMinus.resize(site.resultCount);
+		for (int p = 0; p < site.paramCount; p++)
+		{
+			const double x = callParams[p];
+			const double h = 1e-6 * max(1.0, fabs(x));
+			callParams[p] = x + h;
+			program->callNative(site, callParams.data(), callResultsPlus.data());
+			callParams[p] = x - h;
+			program->callNative(site, callParams.data(), callResultsMinus.data());
+			callParams[p] = x;
+			for (int r = 0; r < site.resultCount; r++)
+				callJacobianValues[r * site.paramCount + p] = (callResultsPlus[r] - callResultsMinus[r]) / (2.0 * h);
+		}
+	}
+};
@@ -0,0 +1,239 @@
+#pragma once
+
+//
+// compiles the residualOutput form of ExpContext::toSourceFiles into a shared object with the
+// system compiler and loads it with dlopen. builds are cached on disk by a hash of the emitted
+// source, so an unchanged expression is never recompiled. with hoistConstants the cache is keyed
+// on ExpContext::structuralHash instead and no source is generated on a hit. linux only, on other
+// platforms compile() fails.
+//
+
+#if defined(__linux__)
+#include <dlfcn.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+struct ExpJitOptions
+{
+	ExpJitOptions()
+	{
+		compiler = "c++";
+		flags = "-O2 -shared -fPIC -std=c++11";
+		cacheDirectory = "expJitCache";
+		hoistConstants = false;
+		reuseTemporaries = false;
+		chunkSize = 0;
+	}
+
+	string compiler;
+	string flags;
+	string cacheDirectory;
+
+	//
+	// extra source placed before the generated function. registered functions are called the same
+	// way with and without hoistConstants, as void name(const T* params, T* results) with
+	// T = double (see ExpCodegenOptions::residualOutput), so the prelude has to define them in
+	// that form, e.g. as a template over T.
+	//
+	string prelude;
+
+	// constants are passed at runtime (see ExpCodegenOptions::hoistConstants), so contexts that only
+	// differ in constant values share one library
+	bool hoistConstants;
+
+	//
+	// passed through to ExpCodegenOptions. with chunkSize > 0 the files from toSourceFiles are
+	// compiled together into one library; the prelude then lands in the shared header, so its
+	// definitions must be templates or inline.
+	//
+	bool reuseTemporaries;
+	int chunkSize;
+};
+
+// paramsB must hold the context's paramBCount values, results receives resultCount values.
+// constants is only read by modules compiled with hoistConstants.
+typedef void(*ExpJitFunction)(const double *paramsA, const double *paramsB, const double *constants, double *results);
+
+struct ExpJitModule
+{
+	ExpJitModule()
+	{
+		handle = nullptr;
+		function = nullptr;
+		cacheHit = false;
+		hoistedConstants = false;
+		structuralHash = 0;
+	}
+
+	~ExpJitModule()
+	{
+		unload();
+	}
+
+	// 64-bit FNV-1a, used as the cache key
+	static unsigned long long hashSource(const string &source)
+	{
+		unsigned long long h = 14695981039346656037ULL;
+		for (unsigned char c : source)
+		{
+			h ^= c;
+			h *= 1099511628211ULL;
+		}
+		return h;
+	}
+
+	// the generated sources plus an entry file defining expJitEntry. every .cpp is compiled into the library
+	static vector<ExpSourceFile> makeSourceFiles(const ExpContext &context, const string &functionName, const ExpJitOptions &options)
+	{
+		ExpCodegenOptions codegen;
+		codegen.residualOutput = true;
+		codegen.hoistConstants = options.hoistConstants;
+		codegen.reuseTemporaries = options.reuseTemporaries;
+		codegen.chunkSize = options.chunkSize;
+		codegen.prelude = "#include <vector>\n#include <cmath>\nusing namespace std;\n\n" + options.prelude;
+		vector<ExpSourceFile> files = context.toSourceFiles(functionName, codegen);
+
+		ExpSourceFile entry;
+		entry.name = functionName + "_entry.cpp";
+		entry.lines.push_back("#include \"" + functionName + ".h\"");
+		entry.lines.push_back("");
+		entry.lines.push_back("extern \"C\" void expJitEntry(const double *paramsA, const double *paramsB, const double *constants, double *results)");
+		entry.lines.push_back("{");
+		if (options.hoistConstants)
+			entry.lines.push_back("    " + functionName + "<double>(paramsA, paramsB, constants, results);");
+		else
+			entry.lines.push_back("    " + functionName + "<double>(paramsA, paramsB, results);");
+		entry.lines.push_back("}");
+		files.push_back(entry);
+		return files;
+	}
+
+	static unsigned long long hashSourceFiles(const vector<ExpSourceFile> &files)
+	{
+		string all;
+		for (const ExpSourceFile &file : files)
+		{
+			all += file.name + "\n";
+			for (const string &line : file.lines)
+				all += line + "\n";
+		}
+		return hashSource(all);
+	}
+
+	// returns false and prints the reason if the module could not be built or loaded
+	bool compile(const ExpContext &context, const string &functionName, const ExpJitOptions &options = ExpJitOptions())
+	{
+		unload();
+#if defined(__linux__)
+		hoistedConstants = options.hoistConstants;
+		structuralHash = options.hoistConstants ? context.structuralHash() : 0;
+		constants = options.hoistConstants ? context.constantTable() : vector<double>();
+
+		// with hoisted constants the source is only generated on a cache miss
+		vector<ExpSourceFile> files;
+		unsigned long long key;
+		const string layout = to_string(options.reuseTemporaries) + " " + to_string(options.chunkSize);
+		if (options.hoistConstants)
+		{
+			key = hashSource(options.compiler + "\n" + options.flags + "\n" + layout + "\n" + options.prelude + "\n" + to_string(structuralHash));
+		}
+		else
+		{
+			files = makeSourceFiles(context, functionName, options);
+			key = hashSource(options.compiler + "\n" + options.flags + "\n" + to_string(hashSourceFiles(files)));
+		}
+		char hashString[32];
+		snprintf(hashString, sizeof(hashString), "%016llx", key);
+
+		mkdir(options.cacheDirectory.c_str(), 0755);
+		const string basePath = options.cacheDirectory + "/" + functionName + "_" + hashString;
+		libraryPath = basePath + ".so";
+
+		cacheHit = access(libraryPath.c_str(), F_OK) == 0;
+		if (!cacheHit)
+		{
+			if (files.empty())
+				files = makeSourceFiles(context, functionName, options);
+			const string sourceDirectory = basePath + "_src";
+			ExpSourceWriter::writeFiles(files, sourceDirectory);
+
+			// build to a temporary name so a concurrent or interrupted build never leaves a partial library
+			const string tempPath = basePath + "." + to_string(getpid()) + ".tmp";
+			string command = options.compiler + " " + options.flags;
+			for (const ExpSourceFile &file : files)
+			{
+				if (file.name.size() > 4 && file.name.compare(file.name.size() - 4, 4, ".cpp") == 0)
+					command += " \"" + sourceDirectory + "/" + file.name + "\"";
+			}
+			command += " -o \"" + tempPath + "\"";
+			if (system(command.c_str()) != 0 || rename(tempPath.c_str(), libraryPath.c_str()) != 0)
+			{
+				cout << "JIT compilation failed: " << command << endl;
+				remove(tempPath.c_str());
+				return false;
+			}
+		}
+
+		handle = dlopen(libraryPath.c_str(), RTLD_NOW | RTLD_LOCAL);
+		if (handle == nullptr)
+		{
+			cout << "dlopen failed: " << dlerror() << endl;
+			return false;
+		}
+
+		function = (ExpJitFunction)dlsym(handle, "expJitEntry");
+		if (function == nullptr)
+		{
+			cout << "dlsym failed: " << dlerror() << endl;
+			unload();
+			return false;
+		}
+		return true;
+#else
+		cout << "JIT compilation is only supported on linux" << endl;
+		return false;
+#endif
+	}
+
+	void eval(const double *paramsA, const double *paramsB, double *results) const
+	{
+		function(paramsA, paramsB, constants.data(), results);
+	}
+
+	// takes the constants of a context with the same structure as the compiled one, without
+	// touching the library. returns false when the structure differs and compile() is needed.
+	bool updateConstants(const ExpContext &context)
+	{
+		if (function == nullptr || !hoistedConstants || context.structuralHash() != structuralHash)
+			return false;
+		constants = context.constantTable();
+		return true;
+	}
+
+	void unload()
+	{
+#if defined(__linux__)
+		if (handle != nullptr)
+			dlclose(handle);
+#endif
+		handle = nullptr;
+		function = nullptr;
+	}
+
+	void *handle;
+	ExpJitFunction function;
+	string libraryPath;
+
+	// true if the last compile() reused a library from the cache directory
+	bool cacheHit;
+
+	// runtime constant table and the structure it belongs to, only used with hoistConstants
+	bool hoistedConstants;
+	unsigned long long structuralHash;
+	vector<double> constants;
+
+private:
+	ExpJitModule(const ExpJitModule &);
+	ExpJitModule& operator = (const ExpJitModule &);
+};
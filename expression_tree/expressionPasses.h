@@ -0,0 +1,500 @@
+#pragma once
+
+//
+// optimization passes over ExpContext::steps. every pass rewrites the step list in place
+// and returns the number of steps it changed. ExpPassManager runs them in order and
+// records per-pass statistics. the analyses at the end of ExpPasses leave the steps alone.
+//
+
+struct ExpPassStats
+{
+	string name;
+	int stepsBefore;
+	int stepsAfter;
+	int stepsChanged;
+	double milliseconds;
+};
+
+typedef function<int(ExpContext &context)> ExpPass;
+
+//
+// storage assignment from ExpPasses::allocateRegisters. scalar steps share registers when their
+// lifetimes do not overlap. function calls are assigned an array from a separate pool per result
+// count, since their outputs are read after the call.
+//
+struct ExpRegisterAllocation
+{
+	// highest step index that reads each step, -1 when nothing does
+	vector<int> lastUse;
+
+	// register for each step, -1 for result and invalid steps. for function calls this is the
+	// index within the array pool for that call's result count.
+	vector<int> registers;
+	int registerCount;
+
+	// arrays in use per function result count
+	map<int, int> arrayCounts;
+};
+
+namespace ExpPasses
+{
+	inline bool isConstant(const ExpContext &context, int stepIndex, double value)
+	{
+		const ExpStepData &s = context.steps[stepIndex];
+		return s.type == ExpStepType::constant && s.value == value;
+	}
+
+	inline double applyOp(ExpOpType op, double a, double b)
+	{
+		switch (op)
+		{
+		case ExpOpType::sin: return sin(a);
+		case ExpOpType::cos: return cos(a);
+		case ExpOpType::tan: return tan(a);
+		case ExpOpType::negate: return -a;
+		case ExpOpType::sqrt: return sqrt(a);
+
+		case ExpOpType::add: return a + b;
+		case ExpOpType::subtract: return a - b;
+		case ExpOpType::multiply: return a * b;
+		case ExpOpType::divide: return a / b;
+		case ExpOpType::pow: return pow(a, b);
+		case ExpOpType::invalid: break;
+		}
+		assert(false);
+		cout << "unknown op" << endl;
+		return 0.0;
+	}
+
+	// calls f on every operand reference of a step, including call parameters in the side table
+	template<class F>
+	inline void forEachOperand(ExpContext &context, ExpStepData &s, F f)
+	{
+		if (s.type == ExpStepType::unaryOp || s.type == ExpStepType::result)
+		{
+			f(s.operand0Step);
+		}
+		else if (s.type == ExpStepType::binaryOp)
+		{
+			f(s.operand0Step);
+			f(s.operand1Step);
+		}
+		else if (s.type == ExpStepType::functionCall)
+		{
+			int *params = context.getCallParams(s);
+			for (int i = 0; i < context.getCallParamCount(s); i++)
+				f(params[i]);
+		}
+		else if (s.type == ExpStepType::functionOutput)
+		{
+			f(s.functionStepIndex);
+		}
+	}
+
+	// read-only version for the analyses, f receives each operand by value
+	template<class F>
+	inline void forEachOperand(const ExpContext &context, const ExpStepData &s, F f)
+	{
+		if (s.type == ExpStepType::unaryOp || s.type == ExpStepType::result)
+		{
+			f(s.operand0Step);
+		}
+		else if (s.type == ExpStepType::binaryOp)
+		{
+			f(s.operand0Step);
+			f(s.operand1Step);
+		}
+		else if (s.type == ExpStepType::functionCall)
+		{
+			const int *params = context.getCallParams(s);
+			for (int i = 0; i < context.getCallParamCount(s); i++)
+				f(params[i]);
+		}
+		else if (s.type == ExpStepType::functionOutput)
+		{
+			f(s.functionStepIndex);
+		}
+	}
+
+	// replaces unary and binary ops whose operands are all constants with a constant
+	inline int constantFolding(ExpContext &context)
+	{
+		int changed = 0;
+		for (int i = 0; i < (int)context.steps.size(); i++)
+		{
+			ExpStepData &s = context.steps[i];
+			if (s.type == ExpStepType::unaryOp && context.steps[s.operand0Step].type == ExpStepType::constant)
+			{
+				s = ExpStepData(applyOp(s.op, context.steps[s.operand0Step].value, 0.0));
+			}
+			else if (s.type == ExpStepType::binaryOp &&
+				context.steps[s.operand0Step].type == ExpStepType::constant &&
+				context.steps[s.operand1Step].type == ExpStepType::constant)
+			{
+				s = ExpStepData(applyOp(s.op, context.steps[s.operand0Step].value, context.steps[s.operand1Step].value));
+			}
+			else
+			{
+				continue;
+			}
+			s.stepIndex = i;
+			changed++;
+		}
+		return changed;
+	}
+
+	// x*1, 1*x, x+0, 0+x, x-0, x/1, pow(x,1) and -(-x) become x. pow(x,2) becomes x*x and
+	// pow(x,0.5) becomes sqrt(x). bypassed steps are left in place for deadStepElimination.
+	// not every rewrite is bit-exact at the edges: -0+0 is +0 where x+0 gives back -0,
+	// pow(-0,0.5) is +0 where sqrt(-0) is -0, and pow(-inf,0.5) is +inf where sqrt(-inf) is
+	// NaN. x-0 keeps the sign of zero, and finite non-zero inputs agree everywhere.
+	inline int algebraicSimplification(ExpContext &context)
+	{
+		int changed = 0;
+		vector<int> replacement(context.steps.size());
+		for (int i = 0; i < (int)context.steps.size(); i++)
+		{
+			replacement[i] = i;
+
+			ExpStepData &s = context.steps[i];
+			forEachOperand(context, s, [&](int &operand) { operand = replacement[operand]; });
+
+			int alias = -1;
+			if (s.type == ExpStepType::binaryOp)
+			{
+				const int a = s.operand0Step;
+				const int b = s.operand1Step;
+				if (s.op == ExpOpType::multiply)
+				{
+					if (isConstant(context, b, 1.0)) alias = a;
+					else if (isConstant(context, a, 1.0)) alias = b;
+				}
+				else if (s.op == ExpOpType::add)
+				{
+					if (isConstant(context, b, 0.0)) alias = a;
+					else if (isConstant(context, a, 0.0)) alias = b;
+				}
+				else if (s.op == ExpOpType::subtract)
+				{
+					if (isConstant(context, b, 0.0)) alias = a;
+				}
+				else if (s.op == ExpOpType::divide)
+				{
+					if (isConstant(context, b, 1.0)) alias = a;
+				}
+				else if (s.op == ExpOpType::pow)
+				{
+					if (isConstant(context, b, 1.0))
+					{
+						alias = a;
+					}
+					else if (isConstant(context, b, 2.0))
+					{
+						s = ExpStepData(ExpOpType::multiply, a, a);
+						s.stepIndex = i;
+						changed++;
+					}
+					else if (isConstant(context, b, 0.5))
+					{
+						s = ExpStepData(ExpOpType::sqrt, a);
+						s.stepIndex = i;
+						changed++;
+					}
+				}
+			}
+			else if (s.type == ExpStepType::unaryOp && s.op == ExpOpType::negate)
+			{
+				const ExpStepData &inner = context.steps[s.operand0Step];
+				if (inner.type == ExpStepType::unaryOp && inner.op == ExpOpType::negate)
+					alias = inner.operand0Step;
+			}
+
+			if (alias != -1)
+			{
+				replacement[i] = alias;
+				changed++;
+			}
+		}
+		return changed;
+	}
+
+	// marks every step that does not reach a result as invalid. renumberSteps removes them.
+	// a context with no registered results is only ever read through eval(), which returns
+	// the last step, so it is left untouched rather than emptied.
+	inline int deadStepElimination(ExpContext &context)
+	{
+		bool hasResult = false;
+		for (const ExpStepData &s : context.steps)
+			hasResult |= (s.type == ExpStepType::result);
+		if (!hasResult)
+			return 0;
+
+		vector<bool> live(context.steps.size(), false);
+		for (int i = (int)context.steps.size() - 1; i >= 0; i--)
+		{
+			ExpStepData &s = context.steps[i];
+			if (s.type == ExpStepType::result)
+				live[i] = true;
+			if (live[i])
+				forEachOperand(context, s, [&](int &operand) { live[operand] = true; });
+		}
+
+		int changed = 0;
+		for (int i = 0; i < (int)context.steps.size(); i++)
+		{
+			if (!live[i] && context.steps[i].type != ExpStepType::invalid)
+			{
+				context.steps[i].type = ExpStepType::invalid;
+				changed++;
+			}
+		}
+		return changed;
+	}
+
+	// drops invalid steps and renumbers the rest so stepIndex matches the position in steps
+	inline int renumberSteps(ExpContext &context)
+	{
+		vector<int> newIndex(context.steps.size(), -1);
+		int count = 0;
+		for (int i = 0; i < (int)context.steps.size(); i++)
+		{
+			if (context.steps[i].type != ExpStepType::invalid)
+				newIndex[i] = count++;
+		}
+
+		int changed = 0;
+		for (int i = 0; i < (int)context.steps.size(); i++)
+		{
+			if (newIndex[i] == -1)
+			{
+				changed++;
+				continue;
+			}
+			ExpStepData &s = context.steps[i];
+			forEachOperand(context, s, [&](int &operand) { operand = newIndex[operand]; });
+			s.stepIndex = newIndex[i];
+			if (newIndex[i] != i)
+			{
+				context.steps[newIndex[i]] = s;
+				changed++;
+			}
+		}
+		context.steps.resize(count);
+
+		unordered_map<int, string> names;
+		for (const auto &it : context.stepNames)
+		{
+			if (newIndex[it.first] != -1)
+				names[newIndex[it.first]] = it.second;
+		}
+		context.stepNames.swap(names);
+
+		context.rebuildStepCache();
+		return changed;
+	}
+
+	// liveness analysis: the highest step index that reads each step, -1 when nothing does
+	inline vector<int> computeLastUse(const ExpContext &context)
+	{
+		vector<int> lastUse(context.steps.size(), -1);
+		for (int i = 0; i < (int)context.steps.size(); i++)
+		{
+			forEachOperand(context, context.steps[i], [&](int operand) { lastUse[operand] = i; });
+		}
+		return lastUse;
+	}
+
+	//
+	// linear scan over the tape using computeLastUse. a register is released at the last step that
+	// reads it, before that step is assigned, so a step may write over one of its own operands.
+	// with arrayCalls false function calls are treated as scalar steps.
+	//
+	inline ExpRegisterAllocation allocateRegisters(const ExpContext &context, bool arrayCalls)
+	{
+		ExpRegisterAllocation allocation;
+		allocation.lastUse = computeLastUse(context);
+		allocation.registers.assign(context.steps.size(), -1);
+		allocation.registerCount = 0;
+
+		vector<int> freeRegisters;
+		map<int, vector<int>> freeArrays;
+		vector<bool> released(context.steps.size(), false);
+		for (int i = 0; i < (int)context.steps.size(); i++)
+		{
+			const ExpStepData &s = context.steps[i];
+			forEachOperand(context, s, [&](int operand)
+			{
+				const ExpStepData &o = context.steps[operand];
+				// x * x lists the same operand twice, it must only be released once
+				if (allocation.lastUse[operand] != i || allocation.registers[operand] == -1 || released[operand])
+					return;
+				released[operand] = true;
+
+				if (arrayCalls && o.type == ExpStepType::functionCall)
+					freeArrays[context.functions.at(context.functionList[o.functionIndex]).resultCount].push_back(allocation.registers[operand]);
+				else
+					freeRegisters.push_back(allocation.registers[operand]);
+			});
+
+			if (s.type == ExpStepType::result || s.type == ExpStepType::invalid)
+				continue;
+
+			int reg;
+			if (arrayCalls && s.type == ExpStepType::functionCall)
+			{
+				const int resultCount = context.functions.at(context.functionList[s.functionIndex]).resultCount;
+				vector<int> &pool = freeArrays[resultCount];
+				if (pool.empty())
+				{
+					reg = allocation.arrayCounts[resultCount]++;
+				}
+				else
+				{
+					reg = pool.back();
+					pool.pop_back();
+				}
+			}
+			else if (freeRegisters.empty())
+			{
+				reg = allocation.registerCount++;
+			}
+			else
+			{
+				reg = freeRegisters.back();
+				freeRegisters.pop_back();
+			}
+			allocation.registers[i] = reg;
+
+			// unread values only need their register for the step itself
+			if (allocation.lastUse[i] == -1)
+			{
+				if (arrayCalls && s.type == ExpStepType::functionCall)
+					freeArrays[context.functions.at(context.functionList[s.functionIndex]).resultCount].push_back(reg);
+				else
+					freeRegisters.push_back(reg);
+			}
+		}
+		return allocation;
+	}
+
+	//
+	// for each result index, the sorted paramsA indices the result reaches. native function
+	// outputs are assumed to depend on all of the call's parameters. the set of each step is
+	// released after its last use, so memory follows the number of live values.
+	//
+	inline vector<vector<int>> computeResultDependencies(const ExpContext &context)
+	{
+		const vector<int> lastUse = computeLastUse(context);
+		vector<vector<int>> reach(context.steps.size());
+		vector<vector<int>> result(context.resultCount);
+		vector<int> merged;
+		for (int i = 0; i < (int)context.steps.size(); i++)
+		{
+			const ExpStepData &s = context.steps[i];
+			if (s.type == ExpStepType::parameter && s.parameterSlot == 0)
+			{
+				reach[i].push_back(s.parameterIndex);
+				continue;
+			}
+
+			forEachOperand(context, s, [&](int operand)
+			{
+				merged.clear();
+				set_union(reach[i].begin(), reach[i].end(), reach[operand].begin(), reach[operand].end(), back_inserter(merged));
+				reach[i].swap(merged);
+			});
+			forEachOperand(context, s, [&](int operand)
+			{
+				if (lastUse[operand] == i)
+					vector<int>().swap(reach[operand]);
+			});
+
+			if (s.type == ExpStepType::result)
+				result[s.resultIndex] = reach[i];
+		}
+		return result;
+	}
+
+	//
+	// writes the resultCount x paramACount jacobian pattern from computeResultDependencies as a
+	// Matrix Market coordinate pattern file, with 1-based indices
+	//
+	inline bool saveJacobianSparsity(const ExpContext &context, const string &filename)
+	{
+		ofstream file(filename);
+		if (!file)
+		{
+			cout << "Could not open " << filename << endl;
+			return false;
+		}
+
+		const vector<vector<int>> dependencies = computeResultDependencies(context);
+		size_t nonZeros = 0;
+		for (const vector<int> &d : dependencies)
+			nonZeros += d.size();
+
+		file << "%%MatrixMarket matrix coordinate pattern general" << endl;
+		file << context.resultCount << " " << context._paramCounts[0] << " " << nonZeros << endl;
+		for (int r = 0; r < (int)dependencies.size(); r++)
+		{
+			for (int p : dependencies[r])
+				file << r + 1 << " " << p + 1 << "\n";
+		}
+		return true;
+	}
+}
+
+struct ExpPassManager
+{
+	void addPass(const string &name, const ExpPass &pass)
+	{
+		passes.push_back(make_pair(name, pass));
+	}
+
+	void addDefaultPasses()
+	{
+		addPass("constantFolding", ExpPasses::constantFolding);
+		addPass("algebraicSimplification", ExpPasses::algebraicSimplification);
+		addPass("constantFolding", ExpPasses::constantFolding);
+		addPass("deadStepElimination", ExpPasses::deadStepElimination);
+		addPass("renumberSteps", ExpPasses::renumberSteps);
+	}
+
+	vector<ExpPassStats> run(ExpContext &context) const
+	{
+		vector<ExpPassStats> result;
+		for (const auto &pass : passes)
+		{
+			ExpPassStats stats;
+			stats.name = pass.first;
+			stats.stepsBefore = (int)context.steps.size();
+			auto start = chrono::high_resolution_clock::now();
+			stats.stepsChanged = pass.second(context);
+			auto end = chrono::high_resolution_clock::now();
+			// passes rewrite steps in place, so steps added afterwards must not hash-cons
+			// against the indices and operands the cache held before the pass
+			context.rebuildStepCache();
+			stats.stepsAfter = (int)context.steps.size();
+			stats.milliseconds = chrono::duration<double, milli>(end - start).count();
+			result.push_back(stats);
+		}
+		return result;
+	}
+
+	static void printStats(const vector<ExpPassStats> &stats)
+	{
+		for (const ExpPassStats &s : stats)
+		{
+			cout << s.name << ": " << s.stepsChanged << " changed, " << s.stepsBefore << " -> " << s.stepsAfter << " steps, " << s.milliseconds << "ms" << endl;
+		}
+	}
+
+	vector<pair<string, ExpPass>> passes;
+};
+
+inline vector<ExpPassStats> ExpContext::optimize()
+{
+	ExpPassManager manager;
+	manager.addDefaultPasses();
+	return manager.run(*this);
+}
@@ -0,0 +1,487 @@
+#pragma once
+
+//
+// compiled form of an ExpContext. steps are lowered into a packed instruction array
+// and evaluated with a dispatch table instead of walking ExpStepData.
+//
+
+enum class ExpOpcode : unsigned char
+{
+	constant,
+	paramA,
+	paramB,
+	result,
+	functionCall,
+	functionOutput,
+
+	// unary ops
+	sin,
+	cos,
+	tan,
+	negate,
+	sqrt,
+
+	// binary ops
+	add,
+	subtract,
+	multiply,
+	divide,
+	pow,
+
+	count
+};
+
+// instruction i always writes values[i], so only the operands are stored.
+// constants: operand0 = index into the constant pool
+// parameters: operand0 = parameter index within the slot
+// results: operand0 = source step, operand1 = result index
+// functionCall: operand0 = call site index
+// functionOutput: operand0 = slot in the function result area, operand1 = output index
+struct ExpInstruction
+{
+	ExpOpcode opcode;
+	int operand0;
+	int operand1;
+};
+
+// a functionCall instruction. parameter step indices live in ExpProgram::callParams and
+// outputs are written to the function result area starting at resultOffset.
+struct ExpCallSite
+{
+	int functionIndex;
+	int paramOffset;
+	int paramCount;
+	int resultOffset;
+	int resultCount;
+};
+
+struct ExpProgram;
+
+struct ExpEvalState
+{
+	double *values;
+	const double *paramsA;
+	const double *paramsB;
+	const double *constants;
+	const int *callParams;
+	const ExpProgram *program;
+
+	// scratch areas at the end of the value buffer, see ExpProgram::valueCount
+	double *functionParams;
+	double *functionResults;
+};
+
+typedef double(*ExpOpHandler)(const ExpInstruction &inst, const ExpEvalState &state);
+
+namespace ExpOpHandlers
+{
+	inline double constant(const ExpInstruction &inst, const ExpEvalState &state) { return state.constants[inst.operand0]; }
+	inline double paramA(const ExpInstruction &inst, const ExpEvalState &state) { return state.paramsA[inst.operand0]; }
+	inline double paramB(const ExpInstruction &inst, const ExpEvalState &state) { return state.paramsB[inst.operand0]; }
+	inline double result(const ExpInstruction &inst, const ExpEvalState &state) { return state.values[inst.operand0]; }
+	inline double functionCall(const ExpInstruction &inst, const ExpEvalState &state);
+	inline double functionOutput(const ExpInstruction &inst, const ExpEvalState &state) { return state.functionResults[inst.operand0]; }
+
+	inline double sin(const ExpInstruction &inst, const ExpEvalState &state) { return std::sin(state.values[inst.operand0]); }
+	inline double cos(const ExpInstruction &inst, const ExpEvalState &state) { return std::cos(state.values[inst.operand0]); }
+	inline double tan(const ExpInstruction &inst, const ExpEvalState &state) { return std::tan(state.values[inst.operand0]); }
+	inline double negate(const ExpInstruction &inst, const ExpEvalState &state) { return -state.values[inst.operand0]; }
+	inline double sqrt(const ExpInstruction &inst, const ExpEvalState &state) { return std::sqrt(state.values[inst.operand0]); }
+
+	inline double add(const ExpInstruction &inst, const ExpEvalState &state) { return state.values[inst.operand0] + state.values[inst.operand1]; }
+	inline double subtract(const ExpInstruction &inst, const ExpEvalState &state) { return state.values[inst.operand0] - state.values[inst.operand1]; }
+	inline double multiply(const ExpInstruction &inst, const ExpEvalState &state) { return state.values[inst.operand0] * state.values[inst.operand1]; }
+	inline double divide(const ExpInstruction &inst, const ExpEvalState &state) { return state.values[inst.operand0] / state.values[inst.operand1]; }
+	inline double pow(const ExpInstruction &inst, const ExpEvalState &state) { return std::pow(state.values[inst.operand0], state.values[inst.operand1]); }
+}
+
+struct ExpProgram
+{
+	ExpProgram()
+	{
+		resultCount = 0;
+		maxCallParams = 0;
+		functionResultCount = 0;
+		registerCount = 0;
+	}
+
+	explicit ExpProgram(const ExpContext &context)
+	{
+		compile(context);
+	}
+
+	// indexed by ExpOpcode, must match the enum order
+	static const ExpOpHandler* dispatchTable()
+	{
+		static const ExpOpHandler table[(int)ExpOpcode::count] =
+		{
+			ExpOpHandlers::constant,
+			ExpOpHandlers::paramA,
+			ExpOpHandlers::paramB,
+			ExpOpHandlers::result,
+			ExpOpHandlers::functionCall,
+			ExpOpHandlers::functionOutput,
+
+			ExpOpHandlers::sin,
+			ExpOpHandlers::cos,
+			ExpOpHandlers::tan,
+			ExpOpHandlers::negate,
+			ExpOpHandlers::sqrt,
+
+			ExpOpHandlers::add,
+			ExpOpHandlers::subtract,
+			ExpOpHandlers::multiply,
+			ExpOpHandlers::divide,
+			ExpOpHandlers::pow,
+		};
+		return table;
+	}
+
+	static ExpOpcode getOpcode(ExpOpType op)
+	{
+		switch (op)
+		{
+		case ExpOpType::sin: return ExpOpcode::sin;
+		case ExpOpType::cos: return ExpOpcode::cos;
+		case ExpOpType::tan: return ExpOpcode::tan;
+		case ExpOpType::negate: return ExpOpcode::negate;
+		case ExpOpType::sqrt: return ExpOpcode::sqrt;
+
+		case ExpOpType::add: return ExpOpcode::add;
+		case ExpOpType::subtract: return ExpOpcode::subtract;
+		case ExpOpType::multiply: return ExpOpcode::multiply;
+		case ExpOpType::divide: return ExpOpcode::divide;
+		case ExpOpType::pow: return ExpOpcode::pow;
+		case ExpOpType::invalid: break;
+		}
+		assert(false);
+		cout << "unknown op" << endl;
+		return ExpOpcode::constant;
+	}
+
+	void compile(const ExpContext &context)
+	{
+		code.clear();
+		constants.clear();
+		callSites.clear();
+		callParams.clear();
+		maxCallParams = 0;
+		functionResultCount = 0;
+		vector<int> callSiteOfStep(context.steps.size(), -1);
+
+		nativeFunctions.assign(context.functionList.size(), ExpNativeFunction());
+		nativeBatchFunctions.assign(context.functionList.size(), ExpNativeBatchFunction());
+		nativeDerivatives.assign(context.functionList.size(), ExpNativeDerivative());
+		for (const auto &f : context.functions)
+		{
+			nativeFunctions[f.second.globalIndex] = f.second.native;
+			nativeBatchFunctions[f.second.globalIndex] = f.second.nativeBatch;
+			nativeDerivatives[f.second.globalIndex] = f.second.derivative;
+		}
+		defaultParamsA.assign(context._paramCounts[0], 0.0);
+		defaultParamsB.assign(context._paramCounts[1], 0.0);
+		resultCount = context.resultCount;
+		resultSteps.assign(resultCount, -1);
+
+		code.reserve(context.steps.size());
+		for (const ExpStepData &s : context.steps)
+		{
+			ExpInstruction inst;
+			inst.operand0 = -1;
+			inst.operand1 = -1;
+			if (s.type == ExpStepType::constant)
+			{
+				inst.opcode = ExpOpcode::constant;
+				inst.operand0 = (int)constants.size();
+				constants.push_back(s.value);
+			}
+			else if (s.type == ExpStepType::parameter)
+			{
+				inst.opcode = s.parameterSlot == 0 ? ExpOpcode::paramA : ExpOpcode::paramB;
+				inst.operand0 = s.parameterIndex;
+				if (s.parameterSlot == 0) defaultParamsA[s.parameterIndex] = s.value;
+				else defaultParamsB[s.parameterIndex] = s.value;
+			}
+			else if (s.type == ExpStepType::result)
+			{
+				inst.opcode = ExpOpcode::result;
+				inst.operand0 = s.operand0Step;
+				inst.operand1 = s.resultIndex;
+				resultSteps[s.resultIndex] = s.stepIndex;
+			}
+			else if (s.type == ExpStepType::unaryOp || s.type == ExpStepType::binaryOp)
+			{
+				inst.opcode = getOpcode(s.op);
+				inst.operand0 = s.operand0Step;
+				inst.operand1 = s.operand1Step;
+			}
+			else if (s.type == ExpStepType::functionCall)
+			{
+				ExpCallSite site;
+				site.functionIndex = s.functionIndex;
+				site.paramOffset = (int)callParams.size();
+				site.paramCount = context.getCallParamCount(s);
+				site.resultOffset = functionResultCount;
+				site.resultCount = context.functions.at(context.functionList[s.functionIndex]).resultCount;
+				callParams.insert(callParams.end(), context.getCallParams(s), context.getCallParams(s) + site.paramCount);
+				maxCallParams = max(maxCallParams, site.paramCount);
+				functionResultCount += site.resultCount;
+
+				inst.opcode = ExpOpcode::functionCall;
+				inst.operand0 = (int)callSites.size();
+				callSiteOfStep[s.stepIndex] = inst.operand0;
+				callSites.push_back(site);
+			}
+			else if (s.type == ExpStepType::functionOutput)
+			{
+				inst.opcode = ExpOpcode::functionOutput;
+				inst.operand0 = callSites[callSiteOfStep[s.functionStepIndex]].resultOffset + s.functionOutputIndex;
+				inst.operand1 = s.functionOutputIndex;
+			}
+			else
+			{
+				assert(false);
+				cout << "unknown ExpStepType" << endl;
+				inst.opcode = ExpOpcode::constant;
+				inst.operand0 = (int)constants.size();
+				constants.push_back(0.0);
+			}
+			code.push_back(inst);
+		}
+
+		compact(context);
+		values.resize(compactValueCount());
+	}
+
+	//
+	// builds compactCode, the same instructions with step operands renamed to the registers from
+	// ExpPasses::allocateRegisters. results are written to a result area after the registers, so
+	// the buffer grows with the number of simultaneously live values rather than with the tape.
+	//
+	void compact(const ExpContext &context)
+	{
+		const ExpRegisterAllocation allocation = ExpPasses::allocateRegisters(context, false);
+		const vector<int> &registers = allocation.registers;
+		registerCount = allocation.registerCount;
+
+		compactCode = code;
+		compactDestinations.resize(code.size());
+		for (size_t i = 0; i < code.size(); i++)
+		{
+			ExpInstruction &inst = compactCode[i];
+			compactDestinations[i] = registers[i];
+			if (inst.opcode == ExpOpcode::result)
+			{
+				inst.operand0 = registers[inst.operand0];
+				compactDestinations[i] = registerCount + inst.operand1;
+			}
+			else if (inst.opcode >= ExpOpcode::add)
+			{
+				inst.operand0 = registers[inst.operand0];
+				inst.operand1 = registers[inst.operand1];
+			}
+			else if (inst.opcode >= ExpOpcode::sin)
+			{
+				inst.operand0 = registers[inst.operand0];
+			}
+		}
+
+		compactCallParams.resize(callParams.size());
+		for (size_t i = 0; i < callParams.size(); i++)
+			compactCallParams[i] = registers[callParams[i]];
+	}
+
+	// size of the buffer evalValues expects: one value per instruction followed by scratch
+	// space for function call parameters and results
+	int valueCount() const
+	{
+		return (int)code.size() + maxCallParams + functionResultCount;
+	}
+
+	// size of the buffer evalCompact expects: registers, the result area, then the same scratch
+	// space as valueCount
+	int compactValueCount() const
+	{
+		return registerCount + resultCount + maxCallParams + functionResultCount;
+	}
+
+	// evaluates with the default parameter values captured at compile time, same as ExpContext::eval
+	double eval()
+	{
+		return eval(defaultParamsA.data(), defaultParamsB.data());
+	}
+
+	// returns the value of the last step, same as ExpContext::eval
+	double eval(const double *paramsA, const double *paramsB)
+	{
+		if (code.empty())
+			return 0.0;
+		run(paramsA, paramsB);
+		return values[compactDestinations.back()];
+	}
+
+	// writes resultCount values into results
+	void evalResults(const double *paramsA, const double *paramsB, double *results)
+	{
+		run(paramsA, paramsB);
+		for (int i = 0; i < resultCount; i++)
+		{
+			results[i] = resultSteps[i] == -1 ? 0.0 : values[registerCount + i];
+		}
+	}
+
+	vector<ExpInstruction> code;
+	vector<double> constants;
+	vector<double> defaultParamsA;
+	vector<double> defaultParamsB;
+	int resultCount;
+
+	vector<ExpCallSite> callSites;
+	vector<int> callParams;
+	int maxCallParams;
+	int functionResultCount;
+
+	// indexed by ExpContext function index, empty when no native binding was given
+	vector<ExpNativeFunction> nativeFunctions;
+	vector<ExpNativeBatchFunction> nativeBatchFunctions;
+	vector<ExpNativeDerivative> nativeDerivatives;
+
+	// runs one call through its binding. with a single lane the SoA layout of the batched binding
+	// is the same as the scalar one. calls without a binding produce zeros.
+	void callNative(const ExpCallSite &site, const double *params, double *results) const
+	{
+		const ExpNativeFunction &native = nativeFunctions[site.functionIndex];
+		const ExpNativeBatchFunction &nativeBatch = nativeBatchFunctions[site.functionIndex];
+		if (native)
+		{
+			native(params, results);
+		}
+		else if (nativeBatch)
+		{
+			nativeBatch(1, params, results);
+		}
+		else
+		{
+			for (int i = 0; i < site.resultCount; i++)
+				results[i] = 0.0;
+		}
+	}
+
+	// step index of the result instruction for each result index
+	vector<int> resultSteps;
+
+	// register-allocated copy of code used by eval, evalResults and ExpBatchEvaluator.
+	// compactCode[i] writes compactDestinations[i], call parameters are read from compactCallParams.
+	vector<ExpInstruction> compactCode;
+	vector<int> compactDestinations;
+	vector<int> compactCallParams;
+	int registerCount;
+
+	// reused across evaluations, laid out as described at compactValueCount
+	vector<double> values;
+
+	// runs the program into a caller-owned buffer of valueCount() values. this does not touch
+	// the program's own buffer, so one program can be shared by several evaluators.
+	void evalValues(const double *paramsA, const double *paramsB, double *valuesOut) const
+	{
+		const ExpOpHandler *table = dispatchTable();
+		ExpEvalState state;
+		state.values = valuesOut;
+		state.paramsA = paramsA;
+		state.paramsB = paramsB;
+		state.constants = constants.data();
+		state.callParams = callParams.data();
+		state.program = this;
+		state.functionParams = valuesOut + code.size();
+		state.functionResults = state.functionParams + maxCallParams;
+
+		const ExpInstruction *inst = code.data();
+		const size_t count = code.size();
+		for (size_t i = 0; i < count; i++)
+		{
+			valuesOut[i] = table[(int)inst[i].opcode](inst[i], state);
+		}
+	}
+
+	// same as evalValues on compactCode, into a caller-owned buffer of compactValueCount() values.
+	// only the result area holds meaningful values afterwards.
+	void evalCompact(const double *paramsA, const double *paramsB, double *valuesOut) const
+	{
+		const ExpOpHandler *table = dispatchTable();
+		ExpEvalState state;
+		state.values = valuesOut;
+		state.paramsA = paramsA;
+		state.paramsB = paramsB;
+		state.constants = constants.data();
+		state.callParams = compactCallParams.data();
+		state.program = this;
+		state.functionParams = valuesOut + registerCount + resultCount;
+		state.functionResults = state.functionParams + maxCallParams;
+
+		const ExpInstruction *inst = compactCode.data();
+		const int *destinations = compactDestinations.data();
+		const size_t count = compactCode.size();
+		for (size_t i = 0; i < count; i++)
+		{
+			valuesOut[destinations[i]] = table[(int)inst[i].opcode](inst[i], state);
+		}
+	}
+
+private:
+	void run(const double *paramsA, const double *paramsB)
+	{
+		evalCompact(paramsA, paramsB, values.data());
+	}
+};
+
+inline double ExpOpHandlers::functionCall(const ExpInstruction &inst, const ExpEvalState &state)
+{
+	const ExpCallSite &site = state.program->callSites[inst.operand0];
+	const int *paramSteps = state.callParams + site.paramOffset;
+	for (int i = 0; i < site.paramCount; i++)
+		state.functionParams[i] = state.values[paramSteps[i]];
+
+	state.program->callNative(site, state.functionParams, state.functionResults + site.resultOffset);
+	return 0.0;
+}
+
+// walks the steps directly. compiling an ExpProgram only pays off when the same context is
+// evaluated repeatedly, so one-off evaluation skips it.
+inline double ExpContext::eval() const
+{
+	if (steps.empty())
+		return 0.0;
+
+	vector<double> values(steps.size());
+	vector<int> callResultOffset(steps.size(), -1);
+	vector<double> callParamValues, callResults;
+	for (int i = 0; i < (int)steps.size(); i++)
+	{
+		const ExpStepData &s = steps[i];
+		if (s.type == ExpStepType::functionCall)
+		{
+			const FunctionInfo &info = functions.at(functionList[s.functionIndex]);
+			callParamValues.resize(getCallParamCount(s));
+			for (int p = 0; p < getCallParamCount(s); p++)
+				callParamValues[p] = values[getCallParams(s)[p]];
+
+			callResultOffset[i] = (int)callResults.size();
+			callResults.resize(callResults.size() + info.resultCount, 0.0);
+			double *results = callResults.data() + callResultOffset[i];
+			if (info.native)
+				info.native(callParamValues.data(), results);
+			else if (info.nativeBatch)
+				info.nativeBatch(1, callParamValues.data(), results);
+			values[i] = 0.0;
+		}
+		else if (s.type == ExpStepType::functionOutput)
+		{
+			values[i] = callResults[callResultOffset[s.functionStepIndex] + s.functionOutputIndex];
+		}
+		else
+		{
+			values[i] = s.eval(values);
+		}
+	}
+	return values.back();
+}
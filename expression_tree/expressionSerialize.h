@@ -0,0 +1,461 @@
+#pragma once
+
+//
+// versioned binary format for ExpContext graphs. the file is a header followed by fixed-size
+// arrays, so it can be memory-mapped and read in place:
+//
+//   ExpGraphHeader
+//   ExpStepRecord[stepCount]
+//   ExpFunctionRecord[functionCount]
+//   int32_t callParams[callParamCount]
+//   char strings[stringTableSize]      (null-terminated names, referenced by offset)
+//
+// native function bindings are not stored and have to be bound again after loading.
+// invalid steps left behind by a pass are rejected on load, so run renumberSteps before saving.
+// all values are stored in host byte order.
+//
+
+#if defined(__linux__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+static const uint32_t ExpGraphMagic = 0x47505845; // "EXPG"
+static const uint32_t ExpGraphVersion = 1;
+
+struct ExpGraphHeader
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t stepCount;
+	uint32_t functionCount;
+	uint32_t callParamCount;
+	uint32_t stringTableSize;
+	int32_t paramACount;
+	int32_t paramBCount;
+	int32_t resultCount;
+	uint32_t reserved;
+};
+
+// constant:       value
+// parameter:      a = slot, b = parameter index, c = name offset, value = default value
+// result:         a = source step, b = result index, c = name offset
+// unaryOp:        a = operand
+// binaryOp:       a, b = operands
+// functionCall:   a = function index, b = offset into callParams, c = parameter count
+// functionOutput: a = call step, b = output index
+struct ExpStepRecord
+{
+	uint8_t type;
+	uint8_t op;
+	uint16_t reserved;
+	int32_t a;
+	int32_t b;
+	int32_t c;
+	double value;
+};
+
+struct ExpFunctionRecord
+{
+	int32_t nameOffset;
+	int32_t paramCount;
+	int32_t resultCount;
+};
+
+namespace ExpSerialize
+{
+	inline int32_t addString(vector<char> &strings, const string &s)
+	{
+		int32_t offset = (int32_t)strings.size();
+		strings.insert(strings.end(), s.begin(), s.end());
+		strings.push_back('\0');
+		return offset;
+	}
+
+	template<class T>
+	inline void append(vector<char> &out, const T *data, size_t count)
+	{
+		const char *bytes = (const char *)data;
+		out.insert(out.end(), bytes, bytes + sizeof(T) * count);
+	}
+
+	inline vector<char> save(const ExpContext &context)
+	{
+		vector<ExpStepRecord> records(context.steps.size());
+		vector<int32_t> callParams;
+		vector<char> strings;
+
+		for (size_t i = 0; i < context.steps.size(); i++)
+		{
+			const ExpStepData &s = context.steps[i];
+			ExpStepRecord &r = records[i];
+			memset(&r, 0, sizeof(r));
+			r.type = (uint8_t)s.type;
+			r.op = (uint8_t)ExpOpType::invalid;
+			r.a = r.b = r.c = -1;
+
+			if (s.type == ExpStepType::constant)
+			{
+				r.value = s.value;
+			}
+			else if (s.type == ExpStepType::parameter)
+			{
+				r.a = s.parameterSlot;
+				r.b = s.parameterIndex;
+				r.c = addString(strings, context.getStepName((int)i));
+				r.value = s.value;
+			}
+			else if (s.type == ExpStepType::result)
+			{
+				r.a = s.operand0Step;
+				r.b = s.resultIndex;
+				r.c = addString(strings, context.getStepName((int)i));
+			}
+			else if (s.type == ExpStepType::unaryOp || s.type == ExpStepType::binaryOp)
+			{
+				r.op = (uint8_t)s.op;
+				r.a = s.operand0Step;
+				r.b = s.operand1Step;
+			}
+			else if (s.type == ExpStepType::functionCall)
+			{
+				r.a = s.functionIndex;
+				r.b = (int32_t)callParams.size();
+				r.c = context.getCallParamCount(s);
+				callParams.insert(callParams.end(), context.getCallParams(s), context.getCallParams(s) + r.c);
+			}
+			else if (s.type == ExpStepType::functionOutput)
+			{
+				r.a = s.functionStepIndex;
+				r.b = s.functionOutputIndex;
+			}
+		}
+
+		vector<ExpFunctionRecord> functionRecords(context.functionList.size());
+		for (size_t i = 0; i < context.functionList.size(); i++)
+		{
+			const ExpContext::FunctionInfo &info = context.functions.at(context.functionList[i]);
+			functionRecords[i].nameOffset = addString(strings, context.functionList[i]);
+			functionRecords[i].paramCount = info.paramCount;
+			functionRecords[i].resultCount = info.resultCount;
+		}
+
+		ExpGraphHeader header;
+		memset(&header, 0, sizeof(header));
+		header.magic = ExpGraphMagic;
+		header.version = ExpGraphVersion;
+		header.stepCount = (uint32_t)records.size();
+		header.functionCount = (uint32_t)functionRecords.size();
+		header.callParamCount = (uint32_t)callParams.size();
+		header.stringTableSize = (uint32_t)strings.size();
+		header.paramACount = context._paramCounts[0];
+		header.paramBCount = context._paramCounts[1];
+		header.resultCount = context.resultCount;
+
+		vector<char> out;
+		append(out, &header, 1);
+		append(out, records.data(), records.size());
+		append(out, functionRecords.data(), functionRecords.size());
+		append(out, callParams.data(), callParams.size());
+		append(out, strings.data(), strings.size());
+		return out;
+	}
+
+	inline bool saveFile(const ExpContext &context, const string &filename)
+	{
+		vector<char> data = save(context);
+		ofstream file(filename, ios::binary);
+		if (!file)
+		{
+			cout << "Could not open " << filename << endl;
+			return false;
+		}
+		file.write(data.data(), data.size());
+		return true;
+	}
+}
+
+// read-only view over a serialized graph. points straight into the buffer, nothing is copied.
+struct ExpGraphView
+{
+	ExpGraphView()
+	{
+		header = nullptr;
+		steps = nullptr;
+		functions = nullptr;
+		callParams = nullptr;
+		strings = nullptr;
+	}
+
+	// returns false and prints the reason if the buffer is not a valid graph
+	bool init(const void *data, size_t size)
+	{
+		*this = ExpGraphView();
+		if (size < sizeof(ExpGraphHeader))
+		{
+			cout << "Graph file too small" << endl;
+			return false;
+		}
+
+		const ExpGraphHeader *h = (const ExpGraphHeader *)data;
+		if (h->magic != ExpGraphMagic || h->version != ExpGraphVersion)
+		{
+			cout << "Unsupported graph file version" << endl;
+			return false;
+		}
+
+		const size_t expectedSize = sizeof(ExpGraphHeader) +
+			sizeof(ExpStepRecord) * h->stepCount +
+			sizeof(ExpFunctionRecord) * h->functionCount +
+			sizeof(int32_t) * h->callParamCount +
+			h->stringTableSize;
+		if (size < expectedSize)
+		{
+			cout << "Graph file truncated" << endl;
+			return false;
+		}
+
+		const char *p = (const char *)data + sizeof(ExpGraphHeader);
+		header = h;
+		steps = (const ExpStepRecord *)p;
+		p += sizeof(ExpStepRecord) * h->stepCount;
+		functions = (const ExpFunctionRecord *)p;
+		p += sizeof(ExpFunctionRecord) * h->functionCount;
+		callParams = (const int32_t *)p;
+		p += sizeof(int32_t) * h->callParamCount;
+		strings = p;
+		if (!validate())
+		{
+			*this = ExpGraphView();
+			return false;
+		}
+		return true;
+	}
+
+	// checks every index in the records against the table it refers to, so toContext and the
+	// evaluators never read outside the buffer. operands must refer to earlier steps, function
+	// names must be unique and invalid steps are not accepted.
+	bool validate() const
+	{
+		const ExpGraphHeader &h = *header;
+		if (h.paramACount < 0 || h.paramBCount < 0 || h.resultCount < 0)
+		{
+			cout << "Graph file has negative counts" << endl;
+			return false;
+		}
+		if (h.stringTableSize > 0 && strings[h.stringTableSize - 1] != '\0')
+		{
+			cout << "Graph file string table is not terminated" << endl;
+			return false;
+		}
+
+		auto validString = [&](int32_t offset) { return offset < 0 || (uint32_t)offset < h.stringTableSize; };
+		unordered_set<string> functionNames;
+		for (uint32_t i = 0; i < h.functionCount; i++)
+		{
+			const ExpFunctionRecord &f = functions[i];
+			if (!validString(f.nameOffset) || f.paramCount < 0 || f.resultCount < 0)
+			{
+				cout << "Graph file has an invalid function record " << i << endl;
+				return false;
+			}
+			if (!functionNames.insert(getString(f.nameOffset)).second)
+			{
+				cout << "Graph file has a duplicate function " << getString(f.nameOffset) << endl;
+				return false;
+			}
+		}
+
+		for (uint32_t i = 0; i < h.stepCount; i++)
+		{
+			const ExpStepRecord &r = steps[i];
+			auto validOperand = [&](int32_t step) { return step >= 0 && (uint32_t)step < i; };
+			bool valid = true;
+			switch ((ExpStepType)r.type)
+			{
+			case ExpStepType::constant:
+				break;
+			case ExpStepType::parameter:
+				valid = (r.a == 0 || r.a == 1) && r.b >= 0 && r.b < (r.a == 0 ? h.paramACount : h.paramBCount) && validString(r.c);
+				break;
+			case ExpStepType::result:
+				valid = validOperand(r.a) && r.b >= 0 && r.b < h.resultCount && validString(r.c);
+				break;
+			case ExpStepType::unaryOp:
+				valid = r.op <= (uint8_t)ExpOpType::sqrt && validOperand(r.a);
+				break;
+			case ExpStepType::binaryOp:
+				valid = r.op >= (uint8_t)ExpOpType::add && r.op <= (uint8_t)ExpOpType::pow && validOperand(r.a) && validOperand(r.b);
+				break;
+			case ExpStepType::functionCall:
+				valid = r.a >= 0 && (uint32_t)r.a < h.functionCount && r.c == functions[r.a].paramCount &&
+					r.b >= 0 && (uint64_t)r.b + (uint64_t)r.c <= h.callParamCount;
+				for (int32_t k = 0; valid && k < r.c; k++)
+					valid = validOperand(callParams[r.b + k]);
+				break;
+			case ExpStepType::functionOutput:
+				valid = validOperand(r.a) && (ExpStepType)steps[r.a].type == ExpStepType::functionCall &&
+					r.b >= 0 && r.b < functions[steps[r.a].a].resultCount;
+				break;
+			default:
+				valid = false;
+			}
+			if (!valid)
+			{
+				cout << "Graph file has an invalid step " << i << endl;
+				return false;
+			}
+		}
+		return true;
+	}
+
+	const char* getString(int32_t offset) const
+	{
+		return offset < 0 ? "" : strings + offset;
+	}
+
+	// rebuilds an ExpContext. steps and the call parameter table are allocated once, only
+	// names allocate.
+	void toContext(ExpContext &context) const
+	{
+		context = ExpContext();
+		context._paramCounts[0] = header->paramACount;
+		context._paramCounts[1] = header->paramBCount;
+		context.resultCount = header->resultCount;
+
+		for (uint32_t i = 0; i < header->functionCount; i++)
+			context.registerFunc(getString(functions[i].nameOffset), functions[i].paramCount, functions[i].resultCount);
+
+		context.steps.resize(header->stepCount);
+		context.callParams.reserve(header->callParamCount + header->stepCount);
+		for (uint32_t i = 0; i < header->stepCount; i++)
+		{
+			const ExpStepRecord &r = steps[i];
+			ExpStepData &s = context.steps[i];
+			s.type = (ExpStepType)r.type;
+			s.stepIndex = (int)i;
+			if (s.type == ExpStepType::constant)
+			{
+				s.value = r.value;
+			}
+			else if (s.type == ExpStepType::parameter)
+			{
+				s.parameterSlot = (unsigned char)r.a;
+				s.parameterIndex = r.b;
+				context.stepNames[(int)i] = getString(r.c);
+				s.value = r.value;
+			}
+			else if (s.type == ExpStepType::result)
+			{
+				s.operand0Step = r.a;
+				s.resultIndex = r.b;
+				context.stepNames[(int)i] = getString(r.c);
+			}
+			else if (s.type == ExpStepType::unaryOp || s.type == ExpStepType::binaryOp)
+			{
+				s.op = (ExpOpType)r.op;
+				s.operand0Step = r.a;
+				s.operand1Step = r.b;
+			}
+			else if (s.type == ExpStepType::functionCall)
+			{
+				s.functionIndex = r.a;
+				s.callParamsIndex = (int)context.callParams.size();
+				context.callParams.push_back(r.c);
+				context.callParams.insert(context.callParams.end(), callParams + r.b, callParams + r.b + r.c);
+			}
+			else if (s.type == ExpStepType::functionOutput)
+			{
+				s.functionStepIndex = r.a;
+				s.functionOutputIndex = r.b;
+			}
+		}
+		context.rebuildStepCache();
+	}
+
+	const ExpGraphHeader *header;
+	const ExpStepRecord *steps;
+	const ExpFunctionRecord *functions;
+	const int32_t *callParams;
+	const char *strings;
+};
+
+// a graph file mapped into memory. on platforms without mmap the file is read into a buffer.
+struct ExpGraphFile
+{
+	ExpGraphFile()
+	{
+		mappedData = nullptr;
+		mappedSize = 0;
+	}
+
+	~ExpGraphFile()
+	{
+		close();
+	}
+
+	bool open(const string &filename)
+	{
+		close();
+#if defined(__linux__)
+		int fd = ::open(filename.c_str(), O_RDONLY);
+		if (fd < 0)
+		{
+			cout << "Could not open " << filename << endl;
+			return false;
+		}
+		struct stat st;
+		if (fstat(fd, &st) != 0 || st.st_size == 0)
+		{
+			::close(fd);
+			cout << "Could not read " << filename << endl;
+			return false;
+		}
+		void *data = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		::close(fd);
+		if (data == MAP_FAILED)
+		{
+			cout << "Could not map " << filename << endl;
+			return false;
+		}
+		mappedData = data;
+		mappedSize = (size_t)st.st_size;
+		return view.init(mappedData, mappedSize);
+#else
+		ifstream file(filename, ios::binary | ios::ate);
+		if (!file)
+		{
+			cout << "Could not open " << filename << endl;
+			return false;
+		}
+		buffer.resize((size_t)file.tellg());
+		file.seekg(0);
+		file.read(buffer.data(), buffer.size());
+		return view.init(buffer.data(), buffer.size());
+#endif
+	}
+
+	void close()
+	{
+#if defined(__linux__)
+		if (mappedData != nullptr)
+			munmap(mappedData, mappedSize);
+#endif
+		mappedData = nullptr;
+		mappedSize = 0;
+		buffer.clear();
+		view = ExpGraphView();
+	}
+
+	ExpGraphView view;
+
+private:
+	ExpGraphFile(const ExpGraphFile &);
+	ExpGraphFile& operator = (const ExpGraphFile &);
+
+	void *mappedData;
+	size_t mappedSize;
+	vector<char> buffer;
+};
@@ -1,6 +1,6 @@
 #pragma once
 
-enum class ExpStepType
+enum class ExpStepType : unsigned char
 {
 	constant,
 	parameter,
@@ -12,7 +12,7 @@ enum class ExpStepType
 	invalid
 };
 
-enum class ExpOpType
+enum class ExpOpType : unsigned char
 {
 	// unary ops
 	sin,
@@ -128,25 +128,27 @@ struct ExpStepData
 	// unary operator constructor
 	ExpStepData(ExpOpType _op, int _operand0Step);
 
-	// parameter constructor. parameterSlotIndex should be 0 or 1.
-	static ExpStepData makeParameter(const string &paramName, double defaultValue, int _parameterSlotIndex, int _parameterIndex);
+	// parameter constructor. parameterSlotIndex should be 0 or 1. the name is kept in ExpContext::stepNames.
+	static ExpStepData makeParameter(double defaultValue, int _parameterSlotIndex, int _parameterIndex);
 
-	// result constructor
-	static ExpStepData makeResult(const string &resultName, int stepIndex, int resultIndex);
+	// result constructor. the name is kept in ExpContext::stepNames.
+	static ExpStepData makeResult(int stepIndex, int resultIndex);
 
-	static ExpStepData makeFunctionCall(int functionIndex, const vector<ExpStep> &parameters);
+	// callParamsIndex is the offset of the parameter list in ExpContext::callParams
+	static ExpStepData makeFunctionCall(int functionIndex, int callParamsIndex);
 
 	static ExpStepData makeFunctionOutput(int funcStepIndex, int outputIndex);
 
 	void init()
 	{
 		type = ExpStepType::invalid;
+		op = ExpOpType::invalid;
+		parameterSlot = 0;
+		reserved = 0;
 		value = numeric_limits<double>::max();
-		parameterIndex = -1;
 		operand0Step = -1;
 		operand1Step = -1;
 		stepIndex = -1;
-		resultIndex = -1;
 	}
 	
 	double eval(const vector<double> &values) const
@@ -211,15 +213,15 @@ struct ExpStepData
 		else if (type == ExpStepType::parameter)
 		{
 			if (parameterSlot == 0)
-				return assignment + "(T) paramsA[" + to_string(parameterIndex) + "]; // " + name;
+				return assignment + "(T) paramsA[" + to_string(parameterIndex) + "]";
 			else if (parameterSlot == 1)
-				return assignment + "(T) paramsB[" + to_string(parameterIndex) + "]; // " + name;
+				return assignment + "(T) paramsB[" + to_string(parameterIndex) + "]";
 			else
 				return "error";
 		}
 		else if (type == ExpStepType::result)
 		{
-			return "result[" + to_string(resultIndex) + "] = s" + to_string(operand0Step) + "; // " + name;
+			return "result[" + to_string(resultIndex) + "] = s" + to_string(operand0Step);
 		}
 		else if (type == ExpStepType::unaryOp)
 		{
@@ -245,29 +247,50 @@ struct ExpStepData
 
 	vector<string> toSourceCode(const ExpContext & parent) const;
 
+	// the layout is kept at 24 bytes. fields that are never valid for the same step type share
+	// storage, and variable-size data (names, call parameter lists) lives in side tables
+	// on ExpContext.
 	ExpStepType type;
-	
-	// valid for constants and variables
-	double value;
+	ExpOpType op;
+
+	// valid for parameters
+	unsigned char parameterSlot;
+	unsigned char reserved;
 
-	// valid for variables
-	int parameterSlot;
-	int parameterIndex;
-	int resultIndex;
-	string name;
+	int stepIndex;
 
-	// valid for functions
-	int functionIndex;
-	vector<int> functionParamStepIndices;
+	union
+	{
+		// valid for unary and binary ops, and the source step of results
+		int operand0Step;
 
-	//valid for function outputs
-	int functionStepIndex;
-	int functionOutputIndex;
+		// valid for parameters
+		int parameterIndex;
 
-	// valid for unary and binary ops
-	ExpOpType op;
-	int operand0Step;
-	int operand1Step;
+		// valid for function calls
+		int functionIndex;
 
-	int stepIndex;
+		// valid for function outputs
+		int functionStepIndex;
+	};
+
+	union
+	{
+		// valid for binary ops
+		int operand1Step;
+
+		// valid for results
+		int resultIndex;
+
+		// valid for function calls, offset into ExpContext::callParams
+		int callParamsIndex;
+
+		// valid for function outputs
+		int functionOutputIndex;
+	};
+
+	// valid for constants and parameters
+	double value;
 };
+
+static_assert(sizeof(ExpStepData) <= 24, "ExpStepData should stay compact, move new variable-size data to a side table on ExpContext");
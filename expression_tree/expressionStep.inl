@@ -191,34 +191,31 @@ inline ExpStepData::ExpStepData(ExpOpType _op, int _operand0Step)
 	operand0Step = _operand0Step;
 }
 
-inline ExpStepData ExpStepData::makeParameter(const string &paramName, double defaultValue, int _parameterSlot, int _parameterIndex)
+inline ExpStepData ExpStepData::makeParameter(double defaultValue, int _parameterSlot, int _parameterIndex)
 {
 	ExpStepData result;
 	result.type = ExpStepType::parameter;
 	result.value = defaultValue;
-	result.parameterSlot = _parameterSlot;
+	result.parameterSlot = (unsigned char)_parameterSlot;
 	result.parameterIndex = _parameterIndex;
-	result.name = paramName;
 	return result;
 }
 
-inline ExpStepData ExpStepData::makeResult(const string &resultName, int stepIndex, int resultIndex)
+inline ExpStepData ExpStepData::makeResult(int stepIndex, int resultIndex)
 {
 	ExpStepData result;
 	result.type = ExpStepType::result;
 	result.operand0Step = stepIndex;
 	result.resultIndex = resultIndex;
-	result.name = resultName;
 	return result;
 }
 
-inline ExpStepData ExpStepData::makeFunctionCall(int functionIndex, const vector<ExpStep> &parameters)
+inline ExpStepData ExpStepData::makeFunctionCall(int functionIndex, int callParamsIndex)
 {
 	ExpStepData result;
 	result.type = ExpStepType::functionCall;
 	result.functionIndex = functionIndex;
-	for (auto &it : parameters)
-		result.functionParamStepIndices.push_back(it.stepIndex);
+	result.callParamsIndex = callParamsIndex;
 	return result;
 }
 
@@ -238,11 +235,13 @@ inline vector<string> ExpStepData::toSourceCode(const ExpContext &parent) const
 	vector<string> result;
 	if (type == ExpStepType::functionCall)
 	{
+		const int paramCount = parent.getCallParamCount(*this);
+		const int *params = parent.getCallParams(*this);
 		string paramList = "";
-		for (int i = 0; i < (int)functionParamStepIndices.size(); i++)
+		for (int i = 0; i < paramCount; i++)
 		{
-			paramList += "s" + to_string(functionParamStepIndices[i]);
-			if (i != functionParamStepIndices.size() - 1)
+			paramList += "s" + to_string(params[i]);
+			if (i != paramCount - 1)
 				paramList += ", ";
 		}
 
@@ -4,6 +4,8 @@
 // deprecated, uses expression trees instead of expression contexts
 //
 
+#include "expressionContext.h"
+
 enum class ETreeType
 {
 	constant,
@@ -169,6 +171,88 @@ private:
 	}
 };
 
+// owns ETreeData nodes in fixed-size blocks and frees them all at once. while an arena is active
+// (see ETreeArena::Scope) every ETree node is allocated from it; without one, nodes fall back to
+// new and are never freed, which is the legacy behavior.
+class ETreeArena
+{
+public:
+	static const size_t blockSize = 4096;
+
+	ETreeArena()
+	{
+		used = blockSize;
+	}
+
+	~ETreeArena()
+	{
+		clear();
+	}
+
+	ETreeData* allocate()
+	{
+		if (used == blockSize)
+		{
+			blocks.push_back(new ETreeData[blockSize]);
+			used = 0;
+		}
+		return &blocks.back()[used++];
+	}
+
+	// frees every node allocated from this arena. trees that point into it become invalid.
+	void clear()
+	{
+		for (ETreeData *block : blocks)
+			delete[] block;
+		blocks.clear();
+		used = blockSize;
+	}
+
+	size_t nodeCount() const
+	{
+		return blocks.empty() ? 0 : (blocks.size() - 1) * blockSize + used;
+	}
+
+	static ETreeArena*& current()
+	{
+		static thread_local ETreeArena *arena = nullptr;
+		return arena;
+	}
+
+	// makes an arena the allocation target for ETree nodes on this thread until the scope ends
+	struct Scope
+	{
+		explicit Scope(ETreeArena &arena)
+		{
+			previous = current();
+			current() = &arena;
+		}
+		~Scope()
+		{
+			current() = previous;
+		}
+		ETreeArena *previous;
+	};
+
+	template<class... Args>
+	static const ETreeData* create(Args&&... args)
+	{
+		ETreeArena *arena = current();
+		if (arena == nullptr)
+			return new ETreeData(std::forward<Args>(args)...);
+		ETreeData *node = arena->allocate();
+		*node = ETreeData(std::forward<Args>(args)...);
+		return node;
+	}
+
+private:
+	ETreeArena(const ETreeArena &);
+	ETreeArena& operator = (const ETreeArena &);
+
+	vector<ETreeData*> blocks;
+	size_t used;
+};
+
 struct ETree
 {
 	ETree()
@@ -181,19 +265,19 @@ struct ETree
 	}
 	explicit ETree(double constantValue)
 	{
-		data = new ETreeData(constantValue);
+		data = ETreeArena::create(constantValue);
 	}
 	ETree(ETreeOpType op, const ETree &left)
 	{
-		data = new ETreeData(op, left.data);
+		data = ETreeArena::create(op, left.data);
 	}
 	ETree(ETreeOpType op, const ETree &left, const ETree &right)
 	{
-		data = new ETreeData(op, left.data, right.data);
+		data = ETreeArena::create(op, left.data, right.data);
 	}
 	ETree(double defaultValue, const string &variableName, int variableIndex)
 	{
-		data = new ETreeData(defaultValue, variableName, variableIndex);
+		data = ETreeArena::create(defaultValue, variableName, variableIndex);
 	}
 
 	double eval() const
@@ -206,6 +290,11 @@ struct ETree
 		return data->toString();
 	}
 
+	// flattens the tree into context and registers it as a result. variable i becomes the paramsA
+	// entry named "v<i>": the first call appends those after any parameters already in context,
+	// later calls for other trees reuse them, so several results can share one parameter vector.
+	void toContext(ExpContext &context, int resultIndex, const string &resultName) const;
+
 	const ETreeData *data;
 };
 
@@ -257,4 +346,104 @@ inline ETree sqrt(const ETree &a)
 inline ETree pow(const ETree &a, const ETree &b)
 {
 	return ETree(ETreeOpType::pow, a, b);
-}
\ No newline at end of file
+}
+
+inline ExpOpType getExpOpType(ETreeOpType op)
+{
+	switch (op)
+	{
+	case ETreeOpType::sin: return ExpOpType::sin;
+	case ETreeOpType::cos: return ExpOpType::cos;
+	case ETreeOpType::tan: return ExpOpType::tan;
+	case ETreeOpType::negate: return ExpOpType::negate;
+	case ETreeOpType::sqrt: return ExpOpType::sqrt;
+	case ETreeOpType::add: return ExpOpType::add;
+	case ETreeOpType::subtract: return ExpOpType::subtract;
+	case ETreeOpType::multiply: return ExpOpType::multiply;
+	case ETreeOpType::divide: return ExpOpType::divide;
+	case ETreeOpType::pow: return ExpOpType::pow;
+	}
+	return ExpOpType::invalid;
+}
+
+inline void ETree::toContext(ExpContext &context, int resultIndex, const string &resultName) const
+{
+	// shared subtrees are emitted once
+	map<const ETreeData*, int> stepOfNode;
+
+	// register every variable up front so paramsA follows variableIndex. subtrees can be
+	// shared, so each node is visited once.
+	map<int, double> variables;
+	unordered_set<const ETreeData*> visited;
+	vector<const ETreeData*> stack(1, data);
+	while (!stack.empty())
+	{
+		const ETreeData *node = stack.back();
+		stack.pop_back();
+		if (!visited.insert(node).second)
+			continue;
+		if (node->type == ETreeType::variable)
+			variables[node->variableIndex] = node->value;
+		if (node->child0 != nullptr) stack.push_back(node->child0);
+		if (node->child1 != nullptr) stack.push_back(node->child1);
+	}
+
+	// variables registered by an earlier call are found by name
+	map<int, int> stepOfVariable;
+	const int variableCount = variables.empty() ? 0 : variables.rbegin()->first + 1;
+	for (int i = 0; i < variableCount; i++)
+	{
+		const string name = "v" + to_string(i);
+		const int existingStep = context.findParam(0, name);
+		if (existingStep != -1)
+		{
+			stepOfVariable[i] = existingStep;
+			continue;
+		}
+		double value = variables.count(i) ? variables[i] : 0.0;
+		stepOfVariable[i] = context.registerParam(0, name, value).stepIndex;
+	}
+
+	// iterative post-order walk, deep trees would overflow the stack with recursion
+	stack.assign(1, data);
+	while (!stack.empty())
+	{
+		const ETreeData *node = stack.back();
+		if (stepOfNode.count(node))
+		{
+			stack.pop_back();
+			continue;
+		}
+
+		const bool child0Ready = node->child0 == nullptr || stepOfNode.count(node->child0);
+		const bool child1Ready = node->child1 == nullptr || stepOfNode.count(node->child1);
+		if (!child0Ready || !child1Ready)
+		{
+			if (!child0Ready) stack.push_back(node->child0);
+			if (!child1Ready) stack.push_back(node->child1);
+			continue;
+		}
+		stack.pop_back();
+
+		int stepIndex = -1;
+		if (node->type == ETreeType::constant)
+		{
+			stepIndex = context.registerConstant(node->value).stepIndex;
+		}
+		else if (node->type == ETreeType::variable)
+		{
+			stepIndex = stepOfVariable[node->variableIndex];
+		}
+		else if (node->type == ETreeType::unaryOp)
+		{
+			stepIndex = context.addStep(ExpStepData(getExpOpType(node->op), stepOfNode[node->child0])).stepIndex;
+		}
+		else if (node->type == ETreeType::binaryOp)
+		{
+			stepIndex = context.addStep(ExpStepData(getExpOpType(node->op), stepOfNode[node->child0], stepOfNode[node->child1])).stepIndex;
+		}
+		stepOfNode[node] = stepIndex;
+	}
+
+	context.registerResult(ExpStep(&context, stepOfNode[data]), resultIndex, resultName);
+}
@@ -6,8 +6,15 @@
 #include <cassert>
 #include <string>
 #include <map>
+#include <unordered_map>
+#include <unordered_set>
 #include <algorithm>
+#include <iterator>
 #include <fstream>
+#include <cstring>
+#include <cstdio>
+#include <cstdint>
+#include <chrono>
 
 #include "ceres/ceres.h"
 #include "glog/logging.h"
@@ -22,7 +29,9 @@ using namespace std;
 
 using namespace std;
 
-//#include "expressionTree.h"
 #include "expressionContext.h"
+#include "expressionTree.h"
+#include "expressionCostFunction.h"
+#include "SuperpixelTarget.h"
 
 #include "testApp.h"
\ No newline at end of file
@@ -32,6 +32,19 @@ vector<ExpStep> RGToHSV(ExpStep v0, ExpStep v1)
 	return v0.context->callFunc("RGToHSV", v0, v1);
 }
 
+// registers RGToHSV with the context, unless a loaded graph already did, and binds the double version above to it
+static void bindRGToHSV(ExpContext &context)
+{
+	if (context.functions.count("RGToHSV") == 0)
+		context.registerFunc("RGToHSV", 2, 3);
+	context.bindFunc("RGToHSV", [](const double *params, double *results)
+	{
+		vector<double> hsv = RGToHSV(params[0], params[1]);
+		for (int i = 0; i < 3; i++)
+			results[i] = hsv[i];
+	});
+}
+
 template<class T>
 T f2(T v0, T v1)
 {
@@ -53,9 +66,390 @@ void TestApp::go()
 	testFunction2(function<ExpStep(ExpStep, ExpStep)>(f1<ExpStep>), function<double(double, double)>(f1<double>), "f1");
 	testFunction2(function<ExpStep(ExpStep, ExpStep)>(f2<ExpStep>), function<double(double, double)>(f2<double>), "f2");
 
+	testBatch();
+
+	testHashConsing();
+
+	testSerialize();
+
+	testExpressionTree();
+
+	testResultDependencies();
+
+	testCostFunction();
+
+	testJit();
+
 	testOptimizer();
 }
 
+void TestApp::testBatch()
+{
+	cout << "testing batch" << endl;
+
+	ExpContext context;
+	bindRGToHSV(context);
+
+	ExpStep x0 = context.registerParam(0, "x0", 0.5);
+	ExpStep x1 = context.registerParam(0, "x1", 0.25);
+	ExpStep b0 = context.registerParam(1, "b0", 2.0);
+	context.registerResult(f1(x0, x1) * b0, 0, "output0");
+	context.registerResult(f2(x0, x1) - b0, 1, "output1");
+
+	ExpProgram program(context);
+
+	// not a multiple of the SIMD width or of the chunk size
+	const int laneCount = 37;
+	vector<double> paramsA(2 * laneCount), paramsB(laneCount), results(2 * laneCount);
+	for (int lane = 0; lane < laneCount; lane++)
+	{
+		paramsA[lane] = rand() % 100 / 50.0 - 1.0;
+		paramsA[laneCount + lane] = rand() % 100 / 50.0 - 1.0;
+		paramsB[lane] = rand() % 100 / 25.0;
+	}
+
+	ExpBatchEvaluator batch(program, 16);
+	batch.eval(laneCount, paramsA.data(), paramsB.data(), results.data());
+
+	double maxDelta = 0.0;
+	for (int lane = 0; lane < laneCount; lane++)
+	{
+		const double laneA[2] = { paramsA[lane], paramsA[laneCount + lane] };
+		const double laneB[1] = { paramsB[lane] };
+		double laneResults[2];
+		program.evalResults(laneA, laneB, laneResults);
+		for (int r = 0; r < 2; r++)
+		{
+			const double delta = fabs(laneResults[r] - results[r * laneCount + lane]);
+			if (delta > maxDelta || delta != delta)
+				maxDelta = delta;
+		}
+	}
+	cout << "batch max delta = " << maxDelta << endl;
+}
+
+void TestApp::testCostFunction()
+{
+	cout << "testing cost function" << endl;
+
+	ExpContext context;
+	bindRGToHSV(context);
+
+	ExpStep x0 = context.registerParam(0, "x0", 0.5);
+	ExpStep x1 = context.registerParam(0, "x1", 0.25);
+	ExpStep b0 = context.registerParam(1, "b0", 2.0);
+	context.registerResult(f1(x0, x1) * b0, 0, "output0");
+	context.registerResult(f2(x0, x1) - b0, 1, "output1");
+
+	ExpProgram program(context);
+	const vector<double> paramsB = program.defaultParamsB;
+	ExpCostFunction cost(program, paramsB);
+
+	const int paramCount = (int)program.defaultParamsA.size();
+	const int resultCount = program.resultCount;
+	for (int testIndex = 0; testIndex < 5; testIndex++)
+	{
+		vector<double> params(paramCount);
+		for (double &p : params)
+			p = rand() % 100 / 50.0 - 1.0;
+
+		vector<double> residuals(resultCount), jacobian(resultCount * paramCount);
+		const double *parameters[1] = { params.data() };
+		double *jacobians[1] = { jacobian.data() };
+		cost.Evaluate(parameters, residuals.data(), jacobians);
+
+		// ceres jacobians are row-major, one row per residual
+		double maxDelta = 0.0;
+		vector<double> plus(resultCount), minus(resultCount);
+		for (int p = 0; p < paramCount; p++)
+		{
+			const double x = params[p];
+			const double eps = 1e-6 * max(1.0, fabs(x));
+			params[p] = x + eps;
+			program.evalResults(params.data(), paramsB.data(), plus.data());
+			params[p] = x - eps;
+			program.evalResults(params.data(), paramsB.data(), minus.data());
+			params[p] = x;
+			for (int r = 0; r < resultCount; r++)
+			{
+				const double fd = (plus[r] - minus[r]) / (2.0 * eps);
+				const double delta = fabs(fd - jacobian[r * paramCount + p]) / max(1.0, fabs(fd));
+				if (delta > maxDelta || delta != delta)
+					maxDelta = delta;
+			}
+		}
+		cout << "cost function jacobian relative delta " << testIndex << " = " << maxDelta << endl;
+	}
+}
+
+// repeated constants, a repeated subexpression and a repeated call, so hash-consing has work to do
+static void makeRepeatedGraph(ExpContext &context)
+{
+	bindRGToHSV(context);
+	ExpStep x0 = context.registerParam(0, "x0", 0.3);
+	ExpStep x1 = context.registerParam(0, "x1", 0.7);
+	ExpStep scaled = x0 * 0.5 + x1 * 0.5;
+	ExpStep repeated = sin(x0 * x1) + sin(x0 * x1);
+	ExpStep calls = RGToHSV(x0, x1)[0] * RGToHSV(x0, x1)[2] + RGToHSV(x0, x1)[1];
+	context.registerResult(scaled * repeated + calls, 0, "output0");
+}
+
+void TestApp::testHashConsing()
+{
+	cout << "testing hash-consing" << endl;
+
+	ExpContext plain, shared;
+	shared.hashConsing = true;
+	makeRepeatedGraph(plain);
+	makeRepeatedGraph(shared);
+
+	cout << "steps without / with hash-consing = " << plain.steps.size() << " / " << shared.steps.size() << endl;
+	cout << "call params without / with = " << plain.callParams.size() << " / " << shared.callParams.size() << endl;
+	cout << "hash-consing delta = " << plain.eval() - shared.eval() << endl;
+
+	//
+	// optimize() renumbers the steps and rebuilds the cache, so building the same expressions
+	// again has to find the renumbered steps instead of appending new ones
+	//
+	ExpContext optimized = shared;
+	optimized.optimize();
+	cout << "optimized hash-consing delta = " << plain.eval() - optimized.eval() << endl;
+	ExpStep x0, x1;
+	for (const ExpStepData &s : optimized.steps)
+	{
+		if (optimized.getStepName(s.stepIndex) == "x0") x0 = ExpStep(&optimized, s.stepIndex);
+		if (optimized.getStepName(s.stepIndex) == "x1") x1 = ExpStep(&optimized, s.stepIndex);
+	}
+	const size_t stepsBefore = optimized.steps.size();
+	ExpStep again = sin(x0 * x1);
+	RGToHSV(x0, x1);
+	cout << "steps added after optimize = " << optimized.steps.size() - stepsBefore << ", reused step in range = " << (again.stepIndex < (int)stepsBefore) << endl;
+}
+
+void TestApp::testSerialize()
+{
+	cout << "testing serialize" << endl;
+
+	ExpContext context;
+	makeRepeatedGraph(context);
+	context.registerFunc("unused", 1, 1);
+
+	const string filename = "serializeTest.expg";
+	ExpSerialize::saveFile(context, filename);
+	ExpGraphFile file;
+	if (!file.open(filename))
+		return;
+	ExpContext loaded;
+	file.view.toContext(loaded);
+	bindRGToHSV(loaded);
+	cout << "loaded steps = " << loaded.steps.size() << " / " << context.steps.size() << endl;
+	cout << "serialize delta = " << context.eval() - loaded.eval() << endl;
+
+	//
+	// damaged copies of the same buffer, each of which init has to refuse
+	//
+	const vector<char> data = ExpSerialize::save(context);
+	ExpGraphView view;
+	const bool truncatedRejected = !view.init(data.data(), data.size() - 1);
+
+	auto damaged = [&](const function<void(ExpGraphHeader&, ExpStepRecord*, ExpFunctionRecord*)> &damage)
+	{
+		vector<char> copy = data;
+		ExpGraphHeader &header = *(ExpGraphHeader *)copy.data();
+		ExpStepRecord *steps = (ExpStepRecord *)(copy.data() + sizeof(ExpGraphHeader));
+		damage(header, steps, (ExpFunctionRecord *)(steps + header.stepCount));
+		return !view.init(copy.data(), copy.size());
+	};
+	const bool forwardOperandRejected = damaged([](ExpGraphHeader &header, ExpStepRecord *steps, ExpFunctionRecord *)
+	{
+		for (uint32_t i = 0; i < header.stepCount; i++)
+		{
+			if ((ExpStepType)steps[i].type == ExpStepType::binaryOp)
+			{
+				steps[i].a = (int32_t)header.stepCount;
+				return;
+			}
+		}
+	});
+	const bool invalidStepRejected = damaged([](ExpGraphHeader &, ExpStepRecord *steps, ExpFunctionRecord *)
+	{
+		steps[0].type = (uint8_t)ExpStepType::invalid;
+	});
+	const bool duplicateFunctionRejected = damaged([](ExpGraphHeader &, ExpStepRecord *, ExpFunctionRecord *functions)
+	{
+		functions[1].nameOffset = functions[0].nameOffset;
+	});
+	cout << "rejected truncated / forward operand / invalid step / duplicate function = " << truncatedRejected << " " <<
+		forwardOperandRejected << " " << invalidStepRejected << " " << duplicateFunctionRejected << endl;
+}
+
+void TestApp::testExpressionTree()
+{
+	cout << "testing expression tree" << endl;
+
+	ETreeArena arena;
+	ETreeArena::Scope scope(arena);
+	ETree v0(0.3, "v0", 0), v1(0.7, "v1", 1);
+	ETree shared = sin(v0 * v1);
+	ETree tree0 = shared * shared + pow(v0, ETree(2.0)) / (v1 - ETree(0.5));
+	ETree tree1 = cos(shared) - sqrt(v1) * v0;
+
+	ExpContext context;
+	tree0.toContext(context, 0, "output0");
+	cout << "tree delta = " << tree0.eval() - context.eval() << ", arena nodes = " << arena.nodeCount() << endl;
+
+	// renumbering must not lose the variables the second tree looks up by name
+	context.optimize();
+	const int paramCount = context._paramCounts[0];
+	tree1.toContext(context, 1, "output1");
+	cout << "second tree delta = " << tree1.eval() - context.eval() << ", params added = " << context._paramCounts[0] - paramCount << endl;
+}
+
+void TestApp::testResultDependencies()
+{
+	cout << "testing result dependencies" << endl;
+
+	ExpContext context;
+	bindRGToHSV(context);
+	vector<ExpStep> p;
+	for (int i = 0; i < 4; i++)
+		p.push_back(context.registerParam(0, "p" + to_string(i), 0.5));
+	ExpStep b0 = context.registerParam(1, "b0", 0.5);
+	context.registerResult(p[0] * p[1], 0, "output0");
+	context.registerResult(sin(p[2]) + b0, 1, "output1");
+	context.registerResult(p[0] + p[1] * 0.5, 2, "output2");
+	context.registerResult(context.registerConstant(2.0), 3, "output3");
+	context.registerResult(RGToHSV(p[1], p[3])[0], 4, "output4");
+
+	// a call output counts as reading every parameter of the call
+	const vector<vector<int>> expected = { { 0, 1 }, { 2 }, { 0, 1 }, {}, { 1, 3 } };
+	cout << "dependencies match = " << (ExpPasses::computeResultDependencies(context) == expected) << endl;
+
+	const string filename = "sparsityTest.mtx";
+	ExpPasses::saveJacobianSparsity(context, filename);
+	ifstream file(filename);
+	string banner, size;
+	getline(file, banner);
+	getline(file, size);
+	cout << "sparsity size line = " << size << " (expected 5 4 7)" << endl;
+
+	//
+	// with blocks { p0, p1 }, { p2 } and { p3 }, results 0 and 2 share a functor over block 0,
+	// result 1 reads block 1, result 3 reads nothing and is left out, and result 4 reads blocks 0 and 2
+	//
+	ExpCodegenOptions options;
+	options.residualOutput = true;
+	options.sparseFunctors = true;
+	options.paramBlockSizes = { 2, 1, 1 };
+	vector<string> signatures;
+	for (const string &line : context.toSourceCode("sparseTest", options))
+	{
+		if (line.find("bool operator()(") != string::npos && line.find("paramsA") == string::npos)
+			signatures.push_back(line.substr(line.find_first_not_of(" \t")));
+	}
+	const vector<string> expectedSignatures = {
+		"bool operator()(const T* const b0, T* residuals) const",
+		"bool operator()(const T* const b1, T* residuals) const",
+		"bool operator()(const T* const b0, const T* const b2, T* residuals) const" };
+	cout << "sparse functor signatures match = " << (signatures == expectedSignatures) << endl;
+}
+
+// two results over f1 and f2 with an extra constant scale, so contexts built with different
+// scales share one structure
+static void makeJitContext(ExpContext &context, double scale)
+{
+	bindRGToHSV(context);
+
+	ExpStep x0 = context.registerParam(0, "x0", 0.5);
+	ExpStep x1 = context.registerParam(0, "x1", 0.25);
+	ExpStep b0 = context.registerParam(1, "b0", 2.0);
+	context.registerResult(f1(x0, x1) * b0, 0, "output0");
+	context.registerResult(f2(x0, x1) * scale - b0, 1, "output1");
+}
+
+// largest difference between the module and the interpreter over a few random parameter sets
+static double jitMaxDelta(const ExpJitModule &module, ExpProgram &program)
+{
+	double maxDelta = 0.0;
+	for (int testIndex = 0; testIndex < 5; testIndex++)
+	{
+		const double paramsA[2] = { rand() % 100 / 50.0 - 1.0, rand() % 100 / 50.0 - 1.0 };
+		const double paramsB[1] = { rand() % 100 / 25.0 };
+		double jitResults[2], programResults[2];
+		module.eval(paramsA, paramsB, jitResults);
+		program.evalResults(paramsA, paramsB, programResults);
+		for (int r = 0; r < 2; r++)
+		{
+			const double delta = fabs(jitResults[r] - programResults[r]);
+			if (delta > maxDelta || delta != delta)
+				maxDelta = delta;
+		}
+	}
+	return maxDelta;
+}
+
+void TestApp::testJit()
+{
+	cout << "testing jit" << endl;
+#if defined(__linux__)
+	ExpContext context, rescaled;
+	makeJitContext(context, 1.25);
+	makeJitContext(rescaled, 3.75);
+	ExpProgram program(context), rescaledProgram(rescaled);
+
+	ExpJitOptions options;
+	options.prelude =
+		"template<class T> void RGToHSV(const T *params, T *results)\n"
+		"{\n"
+		"    results[0] = params[0] + params[1];\n"
+		"    results[1] = params[0] - params[1];\n"
+		"    results[2] = params[0] * params[1];\n"
+		"}\n";
+
+	for (int hoist = 0; hoist < 2; hoist++)
+	{
+		options.hoistConstants = hoist == 1;
+		const string mode = options.hoistConstants ? "hoisted" : "inline";
+
+		ExpJitModule module;
+		if (!module.compile(context, "jitTest", options))
+		{
+			cout << "jit " << mode << " compile failed" << endl;
+			continue;
+		}
+		cout << "jit " << mode << " max delta = " << jitMaxDelta(module, program) << endl;
+
+		// the first compile may or may not find the library, the second always does
+		module.compile(context, "jitTest", options);
+		cout << "jit " << mode << " recompile cacheHit = " << module.cacheHit << endl;
+
+		const bool updated = module.updateConstants(rescaled);
+		cout << "jit " << mode << " updateConstants = " << updated << endl;
+		if (updated)
+			cout << "jit " << mode << " updated max delta = " << jitMaxDelta(module, rescaledProgram) << endl;
+	}
+
+	// register-reused output, and chunked output compiled from the separate files writeFiles produces
+	options.hoistConstants = false;
+	for (int layout = 0; layout < 2; layout++)
+	{
+		options.reuseTemporaries = layout == 0;
+		options.chunkSize = layout == 1 ? 4 : 0;
+		const string mode = layout == 0 ? "reused temporaries" : "chunked";
+
+		ExpJitModule module;
+		if (!module.compile(context, "jitTest", options))
+		{
+			cout << "jit " << mode << " compile failed" << endl;
+			continue;
+		}
+		cout << "jit " << mode << " max delta = " << jitMaxDelta(module, program) << endl;
+	}
+#else
+	cout << "jit is only supported on linux, skipped" << endl;
+#endif
+}
+
 void TestApp::testFunction2(function<ExpStep(ExpStep, ExpStep)>& funcE, function<double(double, double)>& funcD, const string &functionName)
 {
 	cout << "testing function2" << endl;
@@ -67,7 +461,7 @@ void TestApp::testFunction2(function<ExpStep(ExpStep, ExpStep)>& funcE, function
 		double vD = funcD(x0D, x1D);
 
 		ExpContext context;
-		context.registerFunc("RGToHSV", 2, 3);
+		bindRGToHSV(context);
 
 		ExpStep x0E = context.registerParam(0, "x0", x0D);
 		ExpStep x1E = context.registerParam(1, "x1", x1D);
@@ -92,7 +486,31 @@ void TestApp::testFunction2(function<ExpStep(ExpStep, ExpStep)>& funcE, function
 
 		double vEEval = context.eval();
 
+		ExpProgram program(context);
+		double vPEval = program.eval();
+
 		cout << "delta " << testIndex << " = " << vD - vEEval << endl;
+		cout << "program delta " << testIndex << " = " << vEEval - vPEval << endl;
+
+		ExpGradientEvaluator gradient(program);
+		double gradX0;
+		gradient.gradient(program.defaultParamsA.data(), program.defaultParamsB.data(), 0, &gradX0);
+		const double eps = 1e-6 * max(1.0, fabs(x0D));
+		double fdX0 = (funcD(x0D + eps, x1D) - funcD(x0D - eps, x1D)) / (2.0 * eps);
+		cout << "gradient relative delta " << testIndex << " = " << (fdX0 - gradX0) / max(1.0, fabs(fdX0)) << endl;
+
+		ExpContext optimized = context;
+		vector<ExpPassStats> passStats = optimized.optimize();
+		if (testIndex == 0)
+			ExpPassManager::printStats(passStats);
+		cout << "optimized delta " << testIndex << " = " << vEEval - optimized.eval() << endl;
+
+		// without registered results the passes must leave eval() working on the last step
+		ExpContext bare;
+		ExpStep xB = bare.registerParam(0, "x0", x0D);
+		xB * xB + 1.0;
+		bare.optimize();
+		cout << "no-result optimized delta " << testIndex << " = " << (x0D * x0D + 1.0) - bare.eval() << " " << ExpProgram(bare).eval() - bare.eval() << endl;
 	}
 }
 
@@ -165,6 +583,17 @@ struct CostTerm
 	float weight;
 };
 
+void TestApp::addTargetResiduals(Problem &problem, const vector<SuperpixelTarget> &targets, double *params)
+{
+	for (const SuperpixelTarget &target : targets)
+	{
+		vector<float> layerValues(3); // not currently used, would be sampled at (target.x, target.y)
+		RGBColor targetColor(target.color[0], target.color[1], target.color[2]);
+		ceres::CostFunction* costFunction = CostTerm::Create(layerValues, (float)target.weight, targetColor);
+		problem.AddResidualBlock(costFunction, NULL, params);
+	}
+}
+
 void TestApp::testOptimizer()
 {
 	Problem problem;
@@ -174,14 +603,11 @@ void TestApp::testOptimizer()
 	// add all fit constraints
 	//if (mask(i, j) == 0 && constaints(i, j).u >= 0 && constaints(i, j).v >= 0)
 	//    fit = (x(i, j) - constraints(i, j)) * w_fitSqrt
+	// per-pixel targets here; SuperpixelExtractorSuperpixel::MakeTargets produces one target per superpixel instead
+	vector<SuperpixelTarget> targets;
 	for (int pixel = 0; pixel < 5; pixel++)
-	{
-		vector<float> layerValues(3); // not currently used
-		const float pixelWeight = 1.0f;
-		RGBColor targetColor(0.5f, 0.5f, 0.5f);
-		ceres::CostFunction* costFunction = CostTerm::Create(layerValues, pixelWeight, targetColor);
-		problem.AddResidualBlock(costFunction, NULL, allParams.data());
-	}
+		targets.push_back(SuperpixelTarget::pixel(0.5, 0.5, 0.5, pixel, 0));
+	addTargetResiduals(problem, targets, allParams.data());
 
 	cout << "Solving..." << endl;
 
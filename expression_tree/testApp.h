@@ -9,4 +9,28 @@ public:
 	void testFunction2(function<ExpStep(ExpStep, ExpStep)> &funcE, function<double(double, double)> &funcD, const string &functionName);
 
 	void testOptimizer();
+
+	// ExpBatchEvaluator against ExpProgram, lane by lane
+	void testBatch();
+
+	// ExpCostFunction jacobian against finite differences, through a function call
+	void testCostFunction();
+
+	// step sharing with hashConsing against the same graph built without it, and after optimize()
+	void testHashConsing();
+
+	// ExpSerialize round trip through a file, and damaged buffers ExpGraphView has to reject
+	void testSerialize();
+
+	// ETree::toContext against ETree::eval, with a second tree reusing the first one's variables
+	void testExpressionTree();
+
+	// computeResultDependencies, saveJacobianSparsity and the sparseFunctors parameter lists on a small known graph
+	void testResultDependencies();
+
+	// ExpJitModule against ExpProgram, with and without hoisted constants. linux only
+	void testJit();
+
+	// one weighted CostTerm residual block per target
+	void addTargetResiduals(Problem &problem, const vector<SuperpixelTarget> &targets, double *params);
 };
\ No newline at end of file